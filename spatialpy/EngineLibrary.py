@@ -0,0 +1,100 @@
+import ctypes
+import threading
+
+import numpy
+
+from spatialpy.Solver import SimulationError
+
+
+class EngineLibrary:
+    """ Python bindings of the C API (ssa_sdpd-c-simulation-engine/include/spatialpy.h)
+    of a model compiled as a shared library, see Solver.load_library().
+
+    The particle arrays are passed to the engine as pointers to the numpy data, nothing
+    is written to or read from files. An unstable simulation raises a SimulationError,
+    other errors in the engine still exit the process. """
+
+    # The random number generator, the parameter values and the thread barriers of the
+    # engine are global, so simulations of a library run one at a time
+    run_lock = threading.Lock()
+
+    def __init__(self, library_path):
+        """ Constructor.
+        Args:
+            library_path: (str) path of the shared library built by 'make shared'
+        """
+        self.library_path = library_path
+        self.lib = ctypes.CDLL(library_path)
+        double_p = numpy.ctypeslib.ndpointer(numpy.float64, flags='C_CONTIGUOUS')
+        int_p = numpy.ctypeslib.ndpointer(numpy.int32, flags='C_CONTIGUOUS')
+        uint_p = numpy.ctypeslib.ndpointer(numpy.uint32, flags='C_CONTIGUOUS')
+        self.lib.spatialpy_create_system.restype = ctypes.c_void_p
+        self.lib.spatialpy_create_system.argtypes = []
+        self.lib.spatialpy_set_domain.restype = None
+        self.lib.spatialpy_set_domain.argtypes = [ctypes.c_void_p, double_p]
+        self.lib.spatialpy_add_particles.restype = None
+        self.lib.spatialpy_add_particles.argtypes = [
+            ctypes.c_void_p, ctypes.c_size_t, ctypes.c_size_t,
+            double_p, int_p, double_p, double_p, double_p, int_p, uint_p]
+        self.lib.spatialpy_num_parameters.restype = ctypes.c_size_t
+        self.lib.spatialpy_num_parameters.argtypes = []
+        self.lib.spatialpy_parameters.restype = ctypes.POINTER(ctypes.c_double)
+        self.lib.spatialpy_parameters.argtypes = []
+        self.lib.spatialpy_initialize_rdme.restype = None
+        self.lib.spatialpy_initialize_rdme.argtypes = [ctypes.c_void_p, uint_p]
+        self.lib.spatialpy_seed.restype = None
+        self.lib.spatialpy_seed.argtypes = [ctypes.c_long]
+        self.lib.spatialpy_set_num_steps.restype = None
+        self.lib.spatialpy_set_num_steps.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+        self.lib.spatialpy_run_simulation.restype = ctypes.c_int
+        self.lib.spatialpy_run_simulation.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_char_p]
+        self.lib.spatialpy_write_run_report.restype = None
+        self.lib.spatialpy_write_run_report.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+        self.lib.spatialpy_destroy_system.restype = None
+        self.lib.spatialpy_destroy_system.argtypes = [ctypes.c_void_p]
+        self.num_parameters = self.lib.spatialpy_num_parameters()
+
+    def set_parameters(self, values):
+        """ Set the values of all parameters, in the order of Model.listOfParameters. """
+        if len(values) != self.num_parameters:
+            raise ValueError("Expected {0} parameter values, got {1}".format(self.num_parameters, len(values)))
+        if self.num_parameters > 0:
+            parameters = numpy.ctypeslib.as_array(self.lib.spatialpy_parameters(), shape=(self.num_parameters,))
+            parameters[:] = values
+
+    def run(self, particles, parameters, seed, number_of_threads=None, stream_path=None, report_path=None):
+        """ Run one simulation in this process and wait until it has finished.
+        Args:
+            particles: (dict) arrays of the particles and the initial condition, see
+                    Solver.get_particle_arrays()
+            parameters: (list) values of all parameters, None for those in 'particles'
+            seed: (int) the random number seed
+            number_of_threads: (int) solver threads, None to let the engine choose
+            stream_path: (str) file or pipe the output is streamed to, None writes VTK files
+                    to the working directory
+            report_path: (str) file the run report is written to, see Result.get_run_report()
+        Returns:
+            the number of threads used
+        """
+        # the engine updates the populations in place, the caller's initial condition is kept
+        u0 = numpy.array(particles['u0'], dtype=numpy.uint32, order='C')
+        num_particles, num_species = u0.shape
+        with self.run_lock:
+            self.set_parameters(particles['parameters'] if parameters is None else parameters)
+            system = self.lib.spatialpy_create_system()
+            try:
+                self.lib.spatialpy_set_domain(system, particles['domain'])
+                self.lib.spatialpy_add_particles(
+                    system, num_particles, num_species, particles['x'], particles['type'],
+                    particles['nu'], particles['mass'], particles['rho'], particles['solid_tag'], u0)
+                self.lib.spatialpy_initialize_rdme(system, u0)
+                self.lib.spatialpy_seed(seed)
+                num_threads = self.lib.spatialpy_run_simulation(
+                    system, number_of_threads or 0, None if stream_path is None else stream_path.encode())
+                if report_path is not None:
+                    self.lib.spatialpy_write_run_report(system, report_path.encode())
+                if num_threads < 0:
+                    raise SimulationError("The simulation became unstable, see the error printed by the solver")
+                return num_threads
+            finally:
+                self.lib.spatialpy_destroy_system(system)
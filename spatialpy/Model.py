@@ -12,7 +12,11 @@ import math
 
 class Model():
     """ Representation of a spatial biochemical model. """
-    reserved_names = ['vol']
+    # 'vol' and the identifiers of the generated C code that the expressions of
+    # the model can see (the arguments of the propensity functions, the particle
+    # of the boundary conditions and the globals of the model file)
+    reserved_names = ['vol', 'x', 't', 'sd', 'data_fn', 'me', 'system', 'seed',
+                      'input_parameters', 'debug_flag', 'dsfmt']
     special_characters = ['[', ']', '+', '-', '*', '/', '.', '^']
 
 
@@ -53,6 +57,15 @@ class Model():
         self.timestep_size = 1e-5
         self.num_timesteps = None
         self.output_freq = None
+        self.adaptive_timestep = False
+        self.max_timestep = None
+        self.rdme_steps = 1
+        self.chemistry_substeps = 1
+        self.chemistry_integrator = "explicit"
+        self.implicit_diffusion = False
+        self.reduction_freq = None
+        self.reduction_axis = None
+        self.reduction_bins = 0
 
 
     def __str__(self):
@@ -89,13 +102,20 @@ class Model():
         return print_string
 
 
-    def run(self, number_of_trajectories=1, seed=None, timeout=None, number_of_threads=None, debug_level=0, debug=False, profile=False):
+    def run(self, number_of_trajectories=1, seed=None, timeout=None, number_of_threads=None, debug_level=0, debug=False, profile=False,
+            stream=False, checkpoint_freq=None, restart=None, parameters=None, in_process=False):
         """ Simulate the model.
         Args:
             number_of_trajectories: How many trajectories should be run.
             seed: (int) The random seed given to the solver.
             number_of_threads: (int) The number threads the solver will use.
             debug_level: (int) Level of output from the solver: 0, 1, or 2. Default: 0.
+            stream: (bool) Stream the solver output into memory instead of writing VTK files.
+            checkpoint_freq: (int) Write a checkpoint of the solver state every this many steps.
+            restart: (Result or str) Continue the simulation from a checkpoint.
+            parameters: (dict or list of dicts) Parameter values overriding those of the model,
+                    a list runs one trajectory for each entry.
+            in_process: (bool) Run the solver in this process, see Solver.run().
         Returns:
             A SpatialPy.Result object with the results of the simulation.
         """
@@ -103,7 +123,9 @@ class Model():
         sol = Solver(self, debug_level=debug_level)
 
         return sol.run(number_of_trajectories=number_of_trajectories, seed=seed, timeout=timeout,
-                       number_of_threads=number_of_threads, debug=debug, profile=profile)
+                       number_of_threads=number_of_threads, debug=debug, profile=profile, stream=stream,
+                       checkpoint_freq=checkpoint_freq, restart=restart, parameters=parameters,
+                       in_process=in_process)
 
 
     def set_timesteps(self, step_size, num_steps):
@@ -123,6 +145,91 @@ class Model():
         self.num_timesteps = math.ceil(num_steps *  steps_per_output)
         self.output_freq = steps_per_output
 
+    def set_adaptive_timestep(self, adaptive=True, max_timestep=None):
+        """ Let the engine choose the size of each step from the stability limits
+        of the fluid particles (velocity and speed of sound, viscosity and force)
+        and the diffusion of the deterministic species, instead of taking steps of
+        timestep_size.
+        The first step is at most timestep_size. Once the flow settles the steps
+        grow, by at most 20% per step, above timestep_size up to the next output
+        time and max_timestep. The outputs are still at the times of the
+        timespan. Reductions are taken at the first step at or after their time.
+        Static domains take steps of timestep_size. A step size that falls below
+        1e-6 * timestep_size ends the run with a SimulationError.
+        Args:
+            adaptive: bool, False goes back to steps of timestep_size
+            max_timestep: float, largest step, None to limit the steps by the
+                    stability limits and the output times only
+        """
+        if max_timestep is not None and not max_timestep > 0:
+            raise ModelError("max_timestep must be positive")
+        self.adaptive_timestep = bool(adaptive)
+        self.max_timestep = max_timestep
+
+    def set_multirate(self, rdme_steps=1, chemistry_substeps=1):
+        """ Advance the stochastic (RDME) and the deterministic chemistry at other
+        rates than the fluid.
+        The RDME takes one step over every 'rdme_steps' fluid steps, and also
+        catches up before each output, reduction and checkpoint. The deterministic
+        reactions take 'chemistry_substeps' explicit steps within each fluid step,
+        after the diffusion of the step (1: the reactions are part of the flux of
+        the fluid step).
+        Args:
+            rdme_steps: int, fluid steps per RDME step
+            chemistry_substeps: int, chemistry steps per fluid step
+        """
+        if int(rdme_steps) != rdme_steps or rdme_steps < 1:
+            raise ModelError("rdme_steps must be a positive integer")
+        if int(chemistry_substeps) != chemistry_substeps or chemistry_substeps < 1:
+            raise ModelError("chemistry_substeps must be a positive integer")
+        self.rdme_steps = int(rdme_steps)
+        self.chemistry_substeps = int(chemistry_substeps)
+
+    def set_chemistry_integrator(self, method="rosenbrock"):
+        """ Choose how the deterministic reactions are integrated.
+        "rosenbrock" takes linearly implicit (ROS2) steps of the reactions of each
+        particle, with a Jacobian from finite differences, after the diffusion of
+        the step. Stiff reactions (e.g. fast binding and unbinding) then allow the
+        step size of the fluid. See set_multirate() for the number of steps.
+        Args:
+            method: str, "explicit" (default of a model) or "rosenbrock"
+        """
+        if method not in ("explicit", "rosenbrock"):
+            raise ModelError("The chemistry integrator must be 'explicit' or 'rosenbrock'")
+        self.chemistry_integrator = method
+
+    def set_implicit_diffusion(self, implicit=True):
+        """ Take the diffusion of the deterministic species in backward Euler steps,
+        so that large diffusion constants do not limit timestep_size. The linear
+        systems are solved by conjugate gradients with the diffusion operator that
+        is assembled for static domains, so the domain must be static.
+        Args:
+            implicit: bool, False goes back to explicit diffusion
+        """
+        self.implicit_diffusion = bool(implicit)
+
+    def set_reductions(self, step_size, histogram_axis=None, num_bins=10):
+        """ Compute aggregate statistics inside the engine while it runs.
+        At every 'step_size' seconds of simulated time the engine writes one
+        row of per-type particle counts, mean density and velocity, and species
+        totals, see Result.get_reductions().
+        Args:
+            step_size: float, simulated time between reductions
+            histogram_axis: (0, 1 or 2) If set, also bin the species totals
+                            along this axis of the bounding box.
+            num_bins: int, number of histogram bins.
+        """
+        if self.timestep_size is None:
+            raise ModelError("timestep_size is not set")
+        if histogram_axis is not None:
+            if histogram_axis not in (0, 1, 2):
+                raise ModelError("histogram_axis must be 0, 1 or 2")
+            if num_bins < 1:
+                raise ModelError("num_bins must be positive")
+        self.reduction_freq = max(1, math.ceil(round(step_size/self.timestep_size, 10)))
+        self.reduction_axis = histogram_axis
+        self.reduction_bins = 0 if histogram_axis is None else int(num_bins)
+
     def timespan(self, time_span, timestep_size=None):
         """
         Set the time span of simulation. The SSA-SDPD engine does not support
@@ -1,9 +1,11 @@
 import filecmp
+import json
 import math
 import os
 import pickle
 import shutil
 import subprocess
+from concurrent.futures import ProcessPoolExecutor
 
 import numpy
 
@@ -50,9 +52,20 @@ def _plotly_iterate(types, size=5, property_name=None, cmin=None, cmax=None, col
         trace_list.append(trace)
     return trace_list
 
+def _read_vtk_step(filename, debug=False):
+    """ Read the points and arrays of one VTK output file.  This is a module level
+        function so that it can be run in the worker processes of Result.read_steps(). """
+    reader = VTKReader(debug=debug)
+    reader.setfilename(filename)
+    reader.readfile()
+    return (reader.getpoints(), reader.getarrays())
+
 class Result():
     """ Result object for a URDME simulation. """
 
+    # Load uncached timepoints in parallel when the files add up to more than this many bytes
+    PARALLEL_READ_BYTES = 8 * 2**20
+
     def __init__(self, model=None, result_dir=None, loaddata=False):
         self.model = model
         self.U = None
@@ -63,6 +76,10 @@ class Result():
         self.stderr = None
         self.timeout = False
         self.result_dir = result_dir
+        self.cache_size = 512 * 2**20  # bytes of parsed timepoints kept in memory
+        self.num_processes = None  # processes used to load timepoints, None: one per core
+        self._step_cache = OrderedDict()
+        self._step_cache_bytes = 0
 
 
 
@@ -94,7 +111,9 @@ class Result():
         if isinstance(other, Result) and self.result_dir != None and other.result_dir != None:
                 # Compare contents, not shallow compare
                 filecmp.cmpfiles.__defaults__ = (False,)
-                dircmp = filecmp.dircmp(self.result_dir, other.result_dir)
+                # The run report holds timings, it differs between identical runs
+                dircmp = filecmp.dircmp(self.result_dir, other.result_dir,
+                                        ignore=filecmp.DEFAULT_IGNORES + ["run_report.json"])
                 # Raise exception if funny_files
                 assert not dircmp.funny_files
                 if not (dircmp.left_only or dircmp.right_only or dircmp.funny_files or dircmp.diff_files):
@@ -134,6 +153,9 @@ class Result():
                 except Exception as e:
                     raise Exception("Error pickling model, could not pickle the Result output files: "+str(e))
                 state[key] = item
+            # The parsed timepoints are not pickled, they can be read back from the files
+            state['_step_cache'] = OrderedDict()
+            state['_step_cache_bytes'] = 0
 
             return state
 
@@ -159,20 +181,101 @@ class Result():
 
     def read_step(self, step_num, debug=False):
         """ Read the data for simulation step 'step_num'. """
-        reader = VTKReader(debug=debug)
-        num = int(step_num * self.model.output_freq)
-        filename = os.path.join(self.result_dir, "output{0}.vtk".format(num))
-        #print("read_step({0}) opening '{1}'".format(step_num, filename))
-        reader.setfilename(filename)
-        reader.readfile()
-        if reader.getpoints() is None or reader.getarrays() is None:
-            raise ResultError("read_step(step_num={0}): got data = None".format(step_num))
-        points = reader.getpoints()
-        vtk_data = reader.getarrays()
-        return (points, vtk_data)
+        return self.read_steps([step_num], debug=debug)[0]
+
+    def read_steps(self, step_nums, debug=False):
+        """ Read the data for several simulation steps.  Parsed steps are kept in a
+            least-recently-used cache of at most 'cache_size' bytes, and steps that are not
+            cached are loaded in up to 'num_processes' worker processes when there is
+            enough data to make it worthwhile.  The returned arrays are shared with the
+            cache and must not be modified.
+
+        Return:
+            list of (points, vtk_data) tuples, one for each entry of step_nums """
+        if not self.model.output_freq:
+            raise ResultError("No outputs were written (output_freq is 0), use get_reductions()")
+        nums = [int(step_num * self.model.output_freq) for step_num in step_nums]
+        steps = {}
+        missing = []
+        for num in nums:
+            if num in self._step_cache:
+                self._step_cache.move_to_end(num)
+                steps[num] = self._step_cache[num]
+            elif num not in missing:
+                missing.append(num)
+        filenames = [os.path.join(self.result_dir, "output{0}.vtk".format(num)) for num in missing]
+        num_processes = min(len(missing), self.num_processes or os.cpu_count() or 1)
+        if num_processes > 1 and sum(map(os.path.getsize, filenames)) > self.PARALLEL_READ_BYTES:
+            with ProcessPoolExecutor(max_workers=num_processes) as executor:
+                loaded = list(executor.map(_read_vtk_step, filenames, [debug]*len(filenames)))
+        else:
+            loaded = [_read_vtk_step(filename, debug) for filename in filenames]
+        for num, step in zip(missing, loaded):
+            if step[0] is None or step[1] is None:
+                raise ResultError("read_steps(): got data = None for step {0}".format(num))
+            steps[num] = step
+            self._cache_step(num, step)
+        return [steps[num] for num in nums]
+
+    def _cache_step(self, num, step):
+        """ Add a parsed step to the cache, evicting the least recently used steps. """
+        points, vtk_data = step
+        nbytes = points.nbytes + sum(array.nbytes for array in vtk_data.values())
+        if nbytes > self.cache_size:
+            return
+        while self._step_cache and self._step_cache_bytes + nbytes > self.cache_size:
+            _, (old_points, old_data) = self._step_cache.popitem(last=False)
+            self._step_cache_bytes -= old_points.nbytes + sum(array.nbytes for array in old_data.values())
+        self._step_cache[num] = step
+        self._step_cache_bytes += nbytes
 
 
+    def get_reductions(self):
+        """ Get the in-situ reductions computed by the engine, see Model.set_reductions().
+
+        Return:
+            OrderedDict mapping each column of 'reductions.csv' (e.g. 'time',
+            'count[1]', 'rho[1]', 'C[A][1]', 'hist_D[A][0]') to a numpy array
+            with one entry per reduction step. Velocity and density columns are
+            per-type means, species columns are totals."""
+        filename = os.path.join(self.result_dir, "reductions.csv")
+        if not os.path.isfile(filename):
+            raise ResultError("No reductions found, use Model.set_reductions() before running")
+        with open(filename) as fd:
+            header = fd.readline().strip().split(',')
+        data = numpy.loadtxt(filename, delimiter=',', skiprows=1, ndmin=2)
+        reductions = OrderedDict()
+        for i, name in enumerate(header):
+            reductions[name] = data[:, i]
+        return reductions
+
+    def get_run_report(self):
+        """ Get the timing report of the solver run, to find the bottleneck of a model.
+
+        Return:
+            dict read from 'run_report.json': 'wall_seconds', 'num_threads', 'phases' (thread
+            seconds of each phase summed over all threads: sort, neighbor_search, take_step1,
+            pairwise_force, take_step2, barrier_wait, rdme, output_sync, output_async),
+            'threads' (the seconds of each phase for each worker, main, sort and output
+            thread) and 'counters' (neighbor_pairs, rdme_reactions, rdme_diffusions,
+            rdme_heap_updates)."""
+        filename = os.path.join(self.result_dir, "run_report.json")
+        if not os.path.isfile(filename):
+            raise ResultError("No run report found, the solver did not finish")
+        with open(filename) as fd:
+            return json.load(fd)
+
+    def get_checkpoint(self):
+        """ Get the path of the checkpoint written by the solver, see Solver.run(checkpoint_freq=...).
+        It can be passed back to Solver.run(restart=...) to continue the simulation."""
+        filename = os.path.join(self.result_dir, "checkpoint.bin")
+        if not os.path.isfile(filename):
+            raise ResultError("No checkpoint found, use checkpoint_freq when running the solver")
+        return filename
+
     def get_timespan(self):
+        if not self.model.output_freq:
+            raise ResultError("No outputs were written (output_freq is 0), use get_reductions()")
         self.tspan = numpy.linspace(0,self.model.num_timesteps,
                 num=math.ceil(self.model.num_timesteps/self.model.output_freq)+1) * self.model.timestep_size
         return self.tspan
@@ -204,9 +307,7 @@ class Result():
         if spec_name not in self.model.listOfSpecies.keys():
             raise ResultError("Species '{0}' not found".format(spec_name))
 
-        #t_index_arr = numpy.linspace(0,self.model.num_timesteps,
-        #                    num=self.model.num_timesteps+1, dtype=int)
-        t_index_arr = self.get_timespan()
+        t_index_arr = numpy.arange(len(self.get_timespan()))
 
         if timepoints is not None:
             if isinstance(timepoints,float):
@@ -221,8 +322,7 @@ class Result():
             num_timepoints = 1
 
         ret = numpy.zeros( (num_timepoints, num_voxel))
-        for ndx, t_ndx in enumerate(t_index_arr):
-            (_, step) = self.read_step(t_ndx, debug=debug)
+        for ndx, (_, step) in enumerate(self.read_steps(t_index_arr, debug=debug)):
             if deterministic:
                 ret[ndx,:] = step['C['+spec_name+']']
             elif concentration:
@@ -298,7 +398,7 @@ class Result():
             t_ndx = len(self.get_timespan()) + t_ndx
 
         if animated and t_ndx_list is None:
-            t_ndx_list = list(range(int(self.model.num_timesteps/self.model.output_freq)+1))
+            t_ndx_list = list(range(len(self.get_timespan())))
 
         spec_name = "C[{0}]".format(species) if deterministic else "D[{0}]".format(species)
 
@@ -463,8 +563,7 @@ class Result():
             as a 1D array with size (number of voxel).
         """
 
-        t_index_arr = numpy.linspace(0,self.model.num_timesteps,
-                            num=self.model.num_timesteps+1, dtype=int)
+        t_index_arr = numpy.arange(len(self.get_timespan()))
         num_voxel = self.model.mesh.get_num_voxels()
 
         if timepoints is not None:
@@ -478,8 +577,7 @@ class Result():
             num_timepoints = 1
 
         ret = numpy.zeros( (num_timepoints, num_voxel))
-        for ndx, t_ndx in enumerate(t_index_arr):
-            (_, step) = self.read_step(t_ndx)
+        for ndx, (_, step) in enumerate(self.read_steps(t_index_arr)):
             ret[ndx,:] = step[property_name]
         if ret.shape[0] == 1:
             ret = ret.flatten()
@@ -540,7 +638,7 @@ class Result():
             t_ndx = len(self.get_timespan()) + t_ndx
 
         if animated and t_ndx_list is None:
-            t_ndx_list = list(range(int(self.model.num_timesteps/self.model.output_freq)+1))
+            t_ndx_list = list(range(len(self.get_timespan())))
 
         # read data at time point
         time_index = t_ndx_list[0] if animated else t_ndx
@@ -795,5 +893,95 @@ class Result():
         raise Exception("Deprecated")
 
 
+class StreamResult(Result):
+    """ Result object for a simulation whose output was streamed from the solver
+        (see Solver.run(stream=True)).  The snapshots are held in memory as numpy
+        arrays, no VTK files are written. """
+
+    MAGIC = b"SPDSTRM1"
+
+    def __init__(self, model=None, result_dir=None, loaddata=False):
+        Result.__init__(self, model=model, result_dir=result_dir, loaddata=loaddata)
+        self.snapshots = OrderedDict()
+
+    @staticmethod
+    def _read_array(fd, dtype, count):
+        dtype = numpy.dtype(dtype)
+        buf = fd.read(dtype.itemsize * count)
+        if len(buf) != dtype.itemsize * count:
+            raise ResultError("Output stream ended in the middle of a snapshot")
+        return numpy.frombuffer(buf, dtype=dtype)
+
+    def consume(self, fd):
+        """ Read snapshots from the binary stream 'fd' until it is closed.
+        Args:
+            fd: binary file object, the read end of the solver output stream
+        """
+        magic = fd.read(len(self.MAGIC))
+        if len(magic) == 0:
+            return
+        if magic != self.MAGIC:
+            raise ResultError("Output stream does not start with a snapshot header")
+        num_chem, num_stoch = self._read_array(fd, numpy.uint32, 2)
+        chem_names = list(self.model.listOfSpecies.keys())[:num_chem]
+        stoch_names = list(self.model.listOfSpecies.keys())[:num_stoch]
+        while True:
+            header = fd.read(8)
+            if len(header) == 0:
+                break
+            if len(header) != 8:
+                raise ResultError("Output stream ended in the middle of a snapshot")
+            step, num_particles = numpy.frombuffer(header, dtype=numpy.uint32)
+            vtk_data = {}
+            vtk_data['id'] = self._read_array(fd, numpy.int32, num_particles).astype(int)
+            vtk_data['type'] = self._read_array(fd, numpy.int32, num_particles).astype(int)
+            points = self._read_array(fd, numpy.float32, 3*num_particles).reshape(num_particles, 3)
+            vtk_data['v'] = self._read_array(fd, numpy.float64, 3*num_particles).reshape(num_particles, 3)
+            for name in ('rho', 'mass', 'bvf_phi', 'nu'):
+                vtk_data[name] = self._read_array(fd, numpy.float64, num_particles)
+            if num_chem > 0:
+                C = self._read_array(fd, numpy.float64, num_chem*num_particles).reshape(num_particles, num_chem)
+                for s, name in enumerate(chem_names):
+                    vtk_data["C[{0}]".format(name)] = C[:, s]
+            if num_stoch > 0:
+                D = self._read_array(fd, numpy.int32, num_stoch*num_particles).reshape(num_particles, num_stoch).astype(int)
+                for s, name in enumerate(stoch_names):
+                    vtk_data["D[{0}]".format(name)] = D[:, s]
+            self.snapshots[int(step)] = (points, vtk_data)
+        self.data_is_loaded = True
+
+    def read_steps(self, step_nums, debug=False):
+        """ Get the data for several simulation steps from the streamed snapshots. """
+        steps = []
+        for step_num in step_nums:
+            num = int(step_num * self.model.output_freq)
+            if num not in self.snapshots:
+                raise ResultError("read_steps(): step {0} was not streamed".format(num))
+            steps.append(self.snapshots[num])
+        return steps
+
+    def __eq__(self, other):
+        """ Compare the streamed snapshots of two StreamResult objects for equality.
+
+        Params:
+            self: StreamResult object
+            other: StreamResult object to compare against
+        Return:
+            bool """
+
+        if not isinstance(other, StreamResult):
+            return NotImplemented
+        if list(self.snapshots.keys()) != list(other.snapshots.keys()):
+            return False
+        for step, (points, vtk_data) in self.snapshots.items():
+            other_points, other_data = other.snapshots[step]
+            if not numpy.array_equal(points, other_points, equal_nan=True) or vtk_data.keys() != other_data.keys():
+                return False
+            for name, array in vtk_data.items():
+                if not numpy.array_equal(array, other_data[name], equal_nan=True):
+                    return False
+        return True
+
+
 class ResultError(Exception):
     pass
@@ -1,9 +1,16 @@
+import concurrent.futures
+import contextlib
+import fcntl
+import hashlib
 import os
+import platform
 import shutil
+import shlex
 import signal
 import subprocess
 import sys
 import tempfile
+import threading
 import time
 import re
 
@@ -15,8 +22,30 @@ from spatialpy.Result import *
 class Solver:
     """ spatialpy solvers. """
 
-    def __init__(self, model, debug_level=0):
-        """ Constructor. """
+    # Smallest number of particles per solver thread worth calibrating for when
+    # trajectories are run concurrently
+    PARTICLES_PER_THREAD = 500
+    # Number of steps timed by the thread calibration run
+    CALIBRATION_STEPS = 5
+    # Build profiles, see build/Makefile
+    BUILD_PROFILES = ['default', 'native', 'lto', 'pgo']
+    # Maximum number of steps of the training run of the 'pgo' build profile
+    PGO_TRAINING_STEPS = 20
+    # Number of compiled models kept in the cache, the least recently used are removed
+    CACHE_MAX_MODELS = 64
+
+    def __init__(self, model, debug_level=0, build_profile='default'):
+        """ Constructor.
+        Args:
+            build_profile: (str) how the solver is optimized, one of
+                    'default': portable -O3 build,
+                    'native': tuned for the CPU of this machine (-march=native),
+                    'lto': native plus link time optimization across the engine and the model,
+                    'pgo': lto plus profile guided optimization from a short training run
+                    of the model (compiles the solver twice).
+                    The optimized profiles may contract floating point operations (FMA), so
+                    their results are not bitwise identical to those of the default build.
+        """
         # TODO: fix class checking
         # if not isinstance(model, Model):
         #    raise SimulationError("Solver constructors must take a Model as an argument.")
@@ -30,6 +59,10 @@ class Solver:
         self.build_dir = None
         self.executable_name = 'ssa_sdpd'
         self.h = None  # basis function width
+        self.calibrated_threads = {}
+        self.build_profile = build_profile
+        self.library = None
+        self.particle_arrays = None
 
         self.SpatialPy_ROOT = os.path.dirname(
             os.path.abspath(__file__))+"/ssa_sdpd-c-simulation-engine"
@@ -40,6 +73,12 @@ class Solver:
         #print("SpatialPy_ROOTPARAM = "+self.SpatialPy_ROOTPARAM)
 
 
+    def __getstate__(self):
+        """ The loaded library can not be pickled, it is loaded again when needed. """
+        state = self.__dict__.copy()
+        state['library'] = None
+        return state
+
     def __del__(self):
         """ Deconstructor.  Removes the compiled solver."""
         try:
@@ -59,9 +98,49 @@ class Solver:
             self.debugger_process = subprocess.Popen('gdbgui -r', shell=True)
         print(f'Your debugger is running at {self.debugger_url}')
 
-    def compile(self, debug=False, profile=False):
-        """ Compile the model."""
+    def compile(self, debug=False, profile=False, build_profile=None):
+        """ Compile the model.
 
+        The engine is built once into a static library, and the model executable is
+        cached by a hash of the generated propensity file. The particles, h, the fluid
+        constants, the bounding box and gravity of the mesh, the initial condition and
+        the parameter values are read from the input file, so models that only differ
+        in those are not compiled again (the types of the mesh are compiled in). The
+        cache is in $SPATIALPY_CACHE_DIR (default: ~/.cache/spatialpy) and keeps the
+        CACHE_MAX_MODELS most recently used models, see also clear_cache().
+        Builds with a build_profile other than 'default' are cached per machine.
+        """
+        if build_profile is not None:
+            self.build_profile = build_profile
+        if self.build_profile not in self.BUILD_PROFILES:
+            raise SimulationError("Unknown build profile '{0}', use one of {1}".format(
+                self.build_profile, self.BUILD_PROFILES))
+        self.__create_build_dir()
+
+        make_args = []
+        if profile:
+          make_args.append('GPROFFLAG=-pg')
+        if profile or debug:
+          make_args.append('GDB_FLAG=-g')
+        self.executable_path = self.__build_cached(make_args, self.executable_name)
+        self.is_compiled = True
+
+    def load_library(self):
+        """ Load the model into this process as a shared library (see EngineLibrary), so
+        runs skip the process startup and the input and output files. The library is
+        cached like the solver executable; the 'pgo' build profile is built as 'lto'. """
+        from spatialpy.EngineLibrary import EngineLibrary
+        if self.library is None:
+            if self.build_dir is None:
+                self.__create_build_dir()
+            build = lambda: self.__build_cached(['PICFLAG=-fPIC'], 'ssa_sdpd.so', target='shared')
+            # once loaded, the library may be evicted from the cache
+            with self.__cached_file_in_use(build) as library_path:
+                self.library = EngineLibrary(library_path)
+        return self.library
+
+    def __create_build_dir(self):
+        """ Create a new build directory and write the propensity file of the model to it. """
         # Create a unique directory each time call to compile.
         self.build_dir = tempfile.mkdtemp(
             prefix='spatialpy_build_', dir=os.environ.get('SPATIALPY_TMPDIR'))
@@ -70,27 +149,131 @@ class Solver:
             print("Compiling Solver.  Build dir: {0}".format(self.build_dir))
 
         # Write the propensity file
-        self.propfilename = re.sub('[^\w\_]', '', self.model_name) # Match except word characters \w = ([a-zA-Z0-9_]) and \_ = _ replace with ''
+        self.propfilename = re.sub(r'[^\w_]', '', self.model_name) # Match except word characters \w = ([a-zA-Z0-9_]) and _ replace with ''
         self.propfilename = self.propfilename + '_generated_model'
         self.prop_file_name = self.build_dir + '/' + self.propfilename + '.c'
         if self.debug_level > 1:
             print("Creating propensity file {0}".format(self.prop_file_name))
         self.create_propensity_file(file_name=self.prop_file_name)
+        self.input_file_name = os.path.join(self.build_dir, 'particles.bin')
 
-        # Build the solver
+    def __build_cached(self, make_args, name, target=None):
+        """ Build the make target 'target' (default: the solver executable) of the model
+        from the propensity file, unless it is in the cache. Returns the path of the built
+        file 'name' in the cache. """
+        engine_key = self.__engine_key(make_args)
+        with open(self.prop_file_name, 'rb') as fd:
+            model_key = hashlib.sha256(engine_key.encode() + fd.read()).hexdigest()
+        model_dir = os.path.join(self.get_cache_dir(), 'models', model_key)
+        path = os.path.join(model_dir, name)
+        with self.__cache_lock(model_dir):
+            if os.path.isfile(path):
+                if self.debug_level >= 1:
+                    print("Using cached solver {0}".format(path))
+                # the modification time of the entry orders the cache by last use
+                os.utime(model_dir)
+            elif self.build_profile == 'pgo' and target is None:
+                self.__build_pgo(make_args)
+                self.__install(os.path.join(self.build_dir, name), path)
+            else:
+                profile = 'lto' if self.build_profile == 'pgo' else self.build_profile
+                if profile != 'default':
+                    make_args = make_args + ['PROFILE=' + profile]
+                engine_lib = self.__build_engine_library(engine_key, make_args)
+                # other targets are built with other flags, they must not share main.o
+                build_dir = self.build_dir if target is None else os.path.join(self.build_dir, target)
+                os.makedirs(build_dir, exist_ok=True)
+                self.__make(build_dir, make_args + ['MODEL=' + self.prop_file_name, 'ENGINE_LIB=' + engine_lib],
+                            target=target)
+                self.__install(os.path.join(build_dir, name), path)
+        self.__evict_models(keep=model_key)
+        return path
+
+    def __evict_models(self, keep):
+        """ Remove the least recently used models beyond CACHE_MAX_MODELS from the cache,
+        except 'keep' and entries that are being built or used by other processes. """
+        models_dir = os.path.join(self.get_cache_dir(), 'models')
+        try:
+            entries = [os.path.join(models_dir, name) for name in os.listdir(models_dir)
+                       if name != keep and os.path.isdir(os.path.join(models_dir, name))]
+        except OSError:
+            return
+        entries.sort(key=lambda entry: os.stat(entry).st_mtime, reverse=True)
+        for entry in entries[max(self.CACHE_MAX_MODELS - 1, 0):]:
+            # the lock file stays: a process waiting for the lock holds it open
+            with open(entry + '.lock', 'w') as lock_fd:
+                try:
+                    fcntl.flock(lock_fd, fcntl.LOCK_EX | fcntl.LOCK_NB)
+                except OSError:
+                    continue
+                try:
+                    shutil.rmtree(entry, ignore_errors=True)
+                finally:
+                    fcntl.flock(lock_fd, fcntl.LOCK_UN)
+
+    @classmethod
+    def clear_cache(cls):
+        """ Remove the compiled engine libraries and models from the cache. Solvers that
+        were compiled before are compiled again by their next run. """
+        cache_dir = cls.get_cache_dir()
+        for subdir in ['models', 'engine']:
+            shutil.rmtree(os.path.join(cache_dir, subdir), ignore_errors=True)
+
+
+    @staticmethod
+    def get_cache_dir():
+        """ Directory of the engine library and model executable cache. """
+        cache_dir = os.environ.get('SPATIALPY_CACHE_DIR')
+        if not cache_dir:
+            cache_dir = os.path.join(os.environ.get('XDG_CACHE_HOME', os.path.expanduser('~/.cache')), 'spatialpy')
+        return cache_dir
+
+    @contextlib.contextmanager
+    def __cache_lock(self, entry_dir, shared=False):
+        """ Hold an exclusive lock on a cache entry, so concurrent compiles of the same
+        model (e.g. from several processes of a parameter sweep) build it only once. A
+        shared lock is held while the entry is used, it is not evicted then. """
+        os.makedirs(os.path.dirname(entry_dir), exist_ok=True)
+        with open(entry_dir + '.lock', 'w') as lock_fd:
+            fcntl.flock(lock_fd, fcntl.LOCK_SH if shared else fcntl.LOCK_EX)
+            try:
+                yield
+            finally:
+                fcntl.flock(lock_fd, fcntl.LOCK_UN)
+
+    @contextlib.contextmanager
+    def __cached_file_in_use(self, build):
+        """ Hold a shared lock on the cache entry of the file that build() returns the
+        path of, while the file is used. It is built again if it was evicted before the
+        lock was taken. """
+        while True:
+            path = build()
+            with self.__cache_lock(os.path.dirname(path), shared=True):
+                if os.path.isfile(path):
+                    yield path
+                    return
+
+    def __install(self, src, dest):
+        """ Atomically place a built file in the cache. """
+        os.makedirs(os.path.dirname(dest), exist_ok=True)
+        tmp = "{0}.{1}.tmp".format(dest, os.getpid())
+        shutil.copy2(src, tmp)
+        os.replace(tmp, dest)
+
+    def __make(self, build_dir, args, target=None):
         makefile = self.SpatialPy_ROOTDIR+'/build/Makefile'
-        cmd_list = ['cd', self.build_dir, '&&', 'make', '-f', makefile, 'ROOT="' + self.SpatialPy_ROOTPARAM+'"', 'ROOTINC="' + self.SpatialPy_ROOTINC+'"','MODEL=' + self.prop_file_name, 'BUILD='+self.build_dir]
-        if profile:
-          cmd_list.append('GPROFFLAG=-pg')
-        if profile or debug:
-          cmd_list.append('GDB_FLAG=-g')
+        cmd_list = ['cd', shlex.quote(build_dir), '&&', 'make', '-f', makefile, 'ROOT="' + self.SpatialPy_ROOTPARAM+'"', 'ROOTINC="' + self.SpatialPy_ROOTINC+'"']
+        cmd_list += [shlex.quote(arg) for arg in args]
+        if target is not None:
+            cmd_list.append(target)
         cmd = " ".join(cmd_list)
         if self.debug_level > 1:
             print("cmd: {0}\n".format(cmd))
         try:
             handle = subprocess.Popen(
                 cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE, shell=True)
-            return_code = handle.wait()
+            stdout, stderr = handle.communicate()
+            return_code = handle.returncode
         except OSError as e:
             print(
                 "Error, execution of compilation raised an exception: {0}".format(e))
@@ -98,60 +281,313 @@ class Solver:
             raise SimulationError("Compilation of solver failed")
 
         if return_code != 0:
-            try:
-                print("Reading stdout/stderr from process:")
-                print(handle.stdout.read().decode("utf-8"))
-                print(handle.stderr.read().decode("utf-8"))
-            except Exception as e:
-                pass
+            print("Reading stdout/stderr from process:")
+            print(stdout.decode("utf-8"))
+            print(stderr.decode("utf-8"))
             raise SimulationError(
                 "Compilation of solver failed, return_code={0}".format(return_code))
 
         if self.debug_level > 1:
-            print(handle.stdout.read().decode("utf-8"))
-            print(handle.stderr.read().decode("utf-8"))
+            print(stdout.decode("utf-8"))
+            print(stderr.decode("utf-8"))
 
-        self.is_compiled = True
+    def __engine_key(self, make_args):
+        """ Hash of the engine sources, build flags and build profile. Optimized builds
+        also depend on the CPU, so a cache shared between machines keeps them apart. """
+        digest = hashlib.sha256(" ".join(make_args + [self.build_profile]).encode())
+        if self.build_profile != 'default':
+            digest.update(platform.machine().encode())
+            try:
+                with open('/proc/cpuinfo') as fd:
+                    cpu_info = [line for line in fd if line.startswith(('model name', 'flags'))]
+                digest.update("".join(sorted(set(cpu_info))).encode())
+            except OSError:
+                digest.update(platform.processor().encode())
+        for subdir in ['build', 'include', 'src', 'external']:
+            for root, dirs, files in os.walk(os.path.join(self.SpatialPy_ROOT, subdir)):
+                dirs.sort()
+                for name in sorted(files):
+                    if name == 'Makefile' or name.endswith(('.c', '.h')):
+                        path = os.path.join(root, name)
+                        digest.update(os.path.relpath(path, self.SpatialPy_ROOT).encode())
+                        with open(path, 'rb') as fd:
+                            digest.update(fd.read())
+        return digest.hexdigest()
+
+    def __build_engine_library(self, engine_key, make_args):
+        """ Build the model independent part of the solver into libssa_sdpd.a, once for
+        each version of the engine sources and build flags.
+        Returns the path of the library. """
+        engine_dir = os.path.join(self.get_cache_dir(), 'engine', engine_key)
+        engine_lib = os.path.join(engine_dir, 'libssa_sdpd.a')
+        with self.__cache_lock(engine_dir):
+            if not os.path.isfile(engine_lib):
+                lib_build_dir = tempfile.mkdtemp(
+                    prefix='spatialpy_engine_', dir=os.environ.get('SPATIALPY_TMPDIR'))
+                try:
+                    self.__make(lib_build_dir, make_args, target='lib')
+                    self.__install(os.path.join(lib_build_dir, 'libssa_sdpd.a'), engine_lib)
+                finally:
+                    shutil.rmtree(lib_build_dir, ignore_errors=True)
+        return engine_lib
+
+    def __build_pgo(self, make_args):
+        """ Build the solver with profile guided optimization: build an instrumented solver,
+        train it on the first steps of the model and build again using the recorded profile.
+        The engine is compiled with the model, since the profile depends on both. """
+        self.__make(self.build_dir, make_args + ['MODEL=' + self.prop_file_name, 'PROFILE=pgo_generate'])
+        training_dir = tempfile.mkdtemp(
+            prefix='spatialpy_training_', dir=os.environ.get('SPATIALPY_TMPDIR'))
+        try:
+            cmd = [os.path.join(self.build_dir, self.executable_name), '-i', self.input_file_name,
+                   '-s', '1', '-N', str(min(self.model.num_timesteps, self.PGO_TRAINING_STEPS))]
+            if self.debug_level >= 1:
+                print("Training run: {0}".format(" ".join(cmd)))
+            subprocess.run(cmd, cwd=training_dir, stdout=subprocess.DEVNULL, check=True)
+        except subprocess.CalledProcessError as e:
+            raise SimulationError("Training run of the solver failed, return code = {0}".format(e.returncode))
+        finally:
+            shutil.rmtree(training_dir, ignore_errors=True)
+        for name in os.listdir(self.build_dir):
+            if name.endswith(('.o', '.a')) or name == self.executable_name:
+                os.remove(os.path.join(self.build_dir, name))
+        self.__make(self.build_dir, make_args + ['MODEL=' + self.prop_file_name, 'PROFILE=pgo_use'])
 
+    def __parameter_values(self, overrides):
+        """ Values of all parameters of the model, in the order of the generated code,
+        with the values in the dict 'overrides' replacing those of the model. """
+        for name in overrides:
+            if name not in self.model.listOfParameters:
+                raise SimulationError("'{0}' is not a parameter of the model".format(name))
+        self.model.resolve_parameters()
+        namespace = dict(self.model.namespace)
+        values = []
+        for name, parameter in self.model.listOfParameters.items():
+            if name in overrides:
+                value = float(overrides[name])
+            else:
+                value = float(eval(parameter.expression, namespace))
+            namespace[name] = value
+            values.append(value)
+        return values
 
-    def run(self, number_of_trajectories=1, seed=None, timeout=None, number_of_threads=None, debug=False, profile=False):
+    def __schedule_trajectories(self, number_of_trajectories, number_of_threads):
+        """ Split the available cores between concurrently running trajectories and solver
+        threads per trajectory. Running trajectories side by side has no synchronization cost,
+        so extra threads are only given to each trajectory when there are more cores than
+        trajectories, the mesh is large enough and a short calibration run shows a speedup.
+        Returns the number of concurrent trajectories and the threads per trajectory. """
+        try:
+            num_cores = len(os.sched_getaffinity(0))
+        except AttributeError:
+            num_cores = os.cpu_count() or 1
+        if number_of_threads is not None:
+            return max(1, min(number_of_trajectories, num_cores // number_of_threads)), number_of_threads
+        if number_of_trajectories >= num_cores:
+            return num_cores, 1
+        threads = num_cores // number_of_trajectories
+        num_particles = self.model.mesh.get_num_voxels()
+        threads = min(threads, max(1, num_particles // self.PARTICLES_PER_THREAD))
+        if threads > 1 and threads not in self.calibrated_threads:
+            self.calibrated_threads[threads] = self.__calibrate_threads(threads)
+        if threads > 1:
+            threads = self.calibrated_threads[threads]
+        return number_of_trajectories, threads
+
+    def __calibrate_threads(self, threads):
+        """ Time a few steps of the solver with one and with 'threads' threads and return
+        the faster setting. """
+        calibration_dir = tempfile.mkdtemp(
+            prefix='spatialpy_calibration_', dir=os.environ.get('SPATIALPY_TMPDIR'))
+        try:
+            elapsed = {}
+            for num_threads in [1, threads]:
+                cmd = [self.executable_path, '-i', self.input_file_name, '-s', '1',
+                       '-t', str(num_threads), '-N', str(self.CALIBRATION_STEPS)]
+                start = time.monotonic()
+                subprocess.run(cmd, cwd=calibration_dir, stdout=subprocess.DEVNULL,
+                               stderr=subprocess.DEVNULL, check=True)
+                elapsed[num_threads] = time.monotonic() - start
+        finally:
+            shutil.rmtree(calibration_dir, ignore_errors=True)
+        if self.debug_level >= 1:
+            print("Thread calibration: {0}".format(elapsed))
+        return threads if elapsed[threads] < elapsed[1] else 1
+
+    def run(self, number_of_trajectories=1, seed=None, timeout=None, number_of_threads=None, debug=False, profile=False,
+            stream=False, checkpoint_freq=None, restart=None, parameters=None, in_process=False):
         """ Run one simulation of the model.
         Args:
             number_of_trajectories: (int) How many trajectories should be simulated.
             seed: (int) the random number seed (incremented by one for multiple runs).
             timeout: (int) maximum number of seconds the solver can run.
-            number_of_threads: (int) the number threads the solver will use.
+            number_of_threads: (int) the number threads the solver will use. Multiple trajectories
+                    are run concurrently, by default the cores are split between concurrent
+                    trajectories and solver threads automatically.
             debug: (bool) start a gdbgui debugger (also compiles with debug symbols if compilation hasn't happened)
             profile: (bool) output gprof profiling data if available
+            stream: (bool) stream the output from the solver over a pipe into a StreamResult
+                    held in memory, instead of writing and re-reading VTK files.
+            checkpoint_freq: (int) write a checkpoint of the full solver state every this many
+                    steps (a checkpoint is also written when the solver is interrupted), see
+                    Result.get_checkpoint().
+            restart: (Result or str) continue a simulation from a checkpoint. If a Result is given
+                    the simulation continues in its result directory and that Result is returned
+                    (unless stream is set).
+            parameters: (dict or list of dicts) parameter values overriding those of the model,
+                    e.g. {'k1': 0.5}, without compiling the solver again. Parameters defined by
+                    an expression of an overridden parameter are evaluated with the new value.
+                    If a list is given, one trajectory is run for each entry.
+            in_process: (bool) run the solver in this process through its C API (see
+                    load_library()) instead of starting the solver executable. The output is
+                    streamed into a StreamResult. Trajectories run one after the other, timeout,
+                    checkpoints and reductions are not supported.
         Returns:
             Result object.
                 or, if number_of_trajectories > 1
             a list of Result objects
         """
-        if number_of_trajectories > 1:
-            result_list = []
-        # Check if compiled, call compile() if not.
-        if not self.is_compiled:
-            self.compile(debug=debug, profile=profile)
+        if isinstance(parameters, (list, tuple)):
+            if number_of_trajectories not in (1, len(parameters)):
+                raise SimulationError("number_of_trajectories must match the number of parameter sets")
+            number_of_trajectories = len(parameters)
+        if in_process:
+            return self.__run_in_process(number_of_trajectories, seed, number_of_threads, timeout,
+                                         checkpoint_freq, restart, parameters)
+        # Compile if not compiled (or if it was removed from the cache), the executable
+        # stays in the cache until the trajectories have run
+        def build():
+            if not self.is_compiled or not os.path.isfile(self.executable_path):
+                self.compile(debug=debug, profile=profile)
+            return self.executable_path
+        with self.__cached_file_in_use(build):
+            restart_file = None
+            if restart is not None:
+                if number_of_trajectories > 1:
+                    raise SimulationError("Only one trajectory can be restarted from a checkpoint")
+                restart_file = restart.get_checkpoint() if isinstance(restart, Result) else restart
+                restart_file = os.path.abspath(restart_file)
 
-        # Execute the solver
+            concurrency, threads = 1, number_of_threads
+            if number_of_trajectories > 1:
+                concurrency, threads = self.__schedule_trajectories(number_of_trajectories, number_of_threads)
+            run_args = (seed, timeout, threads, profile, stream, checkpoint_freq, restart, restart_file, parameters)
+
+            # Execute the solver
+            processes = set()
+            if concurrency <= 1:
+                result_list = [self.__run_trajectory(run_ndx, processes, *run_args)
+                               for run_ndx in range(number_of_trajectories)]
+            else:
+                with concurrent.futures.ThreadPoolExecutor(max_workers=concurrency) as executor:
+                    futures = [executor.submit(self.__run_trajectory, run_ndx, processes, *run_args)
+                               for run_ndx in range(number_of_trajectories)]
+                    try:
+                        result_list = [future.result() for future in futures]
+                    except KeyboardInterrupt:
+                        for future in futures:
+                            future.cancel()
+                        for process in list(processes):
+                            try:
+                                os.killpg(process.pid, signal.SIGINT)
+                            except ProcessLookupError:
+                                pass
+                        raise
+            if number_of_trajectories > 1:
+                return result_list
+            return result_list[0]
+
+    def __run_in_process(self, number_of_trajectories, seed, number_of_threads, timeout, checkpoint_freq,
+                         restart, parameters):
+        """ Solver.run(in_process=True): run the trajectories through the library of the model. """
+        if timeout is not None or checkpoint_freq is not None or restart is not None:
+            raise SimulationError("timeout, checkpoint_freq and restart need the solver executable, "
+                                  "use in_process=False")
+        if self.model.reduction_freq is not None:
+            raise SimulationError("Reductions are written to a file, use in_process=False")
+        library = self.load_library()
+        result_list = []
         for run_ndx in range(number_of_trajectories):
+            values = None
+            if parameters is not None:
+                run_parameters = parameters[run_ndx] if isinstance(parameters, (list, tuple)) else parameters
+                values = self.__parameter_values(run_parameters)
+            if seed is not None:
+                run_seed = seed + run_ndx
+            else:
+                run_seed = int.from_bytes(os.urandom(4), 'little')
+            result = StreamResult(self.model, tempfile.mkdtemp(
+                prefix='spatialpy_result_', dir=os.environ.get('SPATIALPY_TMPDIR')))
+            stream_read, stream_write = os.pipe()
+            stream_errors = []
+            def consume_stream(fd=os.fdopen(stream_read, 'rb')):
+                try:
+                    with fd:
+                        result.consume(fd)
+                except Exception as e:
+                    stream_errors.append(e)
+            stream_reader = threading.Thread(target=consume_stream)
+            stream_reader.start()
+            try:
+                library.run(self.particle_arrays, values, run_seed, number_of_threads,
+                            "/dev/fd/{0}".format(stream_write),
+                            os.path.join(result.result_dir, "run_report.json"))
+            finally:
+                os.close(stream_write)
+                stream_reader.join()
+            if stream_errors:
+                raise SimulationError(
+                    "Reading the solver output stream failed: {0}".format(stream_errors[0]))
+            result.success = True
+            result_list.append(result)
+        if number_of_trajectories > 1:
+            return result_list
+        return result_list[0]
+
+    def __run_trajectory(self, run_ndx, processes, seed, timeout, number_of_threads, profile, stream,
+                         checkpoint_freq, restart, restart_file, parameters):
+        """ Run trajectory 'run_ndx' of Solver.run(). """
+        if isinstance(restart, Result) and not stream:
+            outfile = restart.result_dir
+        else:
             outfile = tempfile.mkdtemp(
                 prefix='spatialpy_result_', dir=os.environ.get('SPATIALPY_TMPDIR'))
+        solver_cmd = 'cd {0}'.format(
+            outfile) + ";" + shlex.quote(self.executable_path) + " -i " + shlex.quote(self.input_file_name)
+        pass_fds = ()
+        stream_reader = None
+        if stream:
+            result = StreamResult(self.model, outfile)
+            stream_read, stream_write = os.pipe()
+            pass_fds = (stream_write,)
+            solver_cmd += " -S /dev/fd/{0}".format(stream_write)
+        elif isinstance(restart, Result):
+            result = restart
+            result._step_cache.clear()
+            result._step_cache_bytes = 0
+        else:
             result = Result(self.model, outfile)
-            solver_cmd = 'cd {0}'.format(
-                outfile) + ";" + os.path.join(self.build_dir, self.executable_name)
 
-            if number_of_threads is not None:
-                solver_cmd += " -t " + str(number_of_threads)
+        if number_of_threads is not None:
+            solver_cmd += " -t " + str(number_of_threads)
 
-            if seed is not None:
-                solver_cmd += " -s "+str(seed+run_ndx)
+        if parameters is not None:
+            run_parameters = parameters[run_ndx] if isinstance(parameters, (list, tuple)) else parameters
+            solver_cmd += " -p " + ",".join(repr(value) for value in self.__parameter_values(run_parameters))
+
+        if seed is not None:
+            solver_cmd += " -s "+str(seed+run_ndx)
 
-            if self.debug_level > 1:
-                print('cmd: {0}\n'.format(solver_cmd))
-            stdout = ''
-            stderr = ''
+        if checkpoint_freq is not None:
+            solver_cmd += " -c "+str(int(checkpoint_freq))
+
+        if restart_file is not None:
+            solver_cmd += " -r "+shlex.quote(restart_file)
+
+        if self.debug_level > 1:
+            print('cmd: {0}\n'.format(solver_cmd))
+        stdout = ''
+        stderr = ''
 #            try:
 #                if self.debug_level >= 1:  #stderr & stdout to the terminal
 #                    handle = subprocess.Popen(solver_cmd, shell=True)
@@ -163,10 +599,24 @@ class Solver:
 #            except OSError as e:
 #                print("Error, execution of solver raised an exception: {0}".format(e))
 #                print("cmd = {0}".format(solver_cmd))
-            try:
-                start = time.monotonic()
-                return_code = None
-                with subprocess.Popen(solver_cmd, shell=True, stdout=subprocess.PIPE, start_new_session=True) as process:
+        try:
+            start = time.monotonic()
+            return_code = None
+            with subprocess.Popen(solver_cmd, shell=True, stdout=subprocess.PIPE, start_new_session=True,
+                                  pass_fds=pass_fds) as process:
+                processes.add(process)
+                try:
+                    if stream:
+                        os.close(stream_write)
+                        stream_errors = []
+                        def consume_stream(fd=os.fdopen(stream_read, 'rb')):
+                            try:
+                                with fd:
+                                    result.consume(fd)
+                            except Exception as e:
+                                stream_errors.append(e)
+                        stream_reader = threading.Thread(target=consume_stream)
+                        stream_reader.start()
                     try:
                         if timeout is not None:
                             stdout, stderr = process.communicate(
@@ -205,39 +655,42 @@ class Solver:
                         if stderr is not None:
                             message += stderr.decode('utf-8')
                         #raise SimulationTimeout(message)
-            except OSError as e:
-                print(
-                    "Error, execution of solver raised an exception: {0}".format(e))
-                print("cmd = {0}".format(solver_cmd))
-
-            if return_code is not None and return_code != 0:
-                if self.debug_level >= 1:
-                    try:
-                        print(stderr)
-                        print(stdout)
-                    except Exception as e:
-                        pass
-                print("solver_cmd = {0}".format(solver_cmd))
+                finally:
+                    # the process group is gone, its id may be reused
+                    processes.discard(process)
+        except OSError as e:
+            print(
+                "Error, execution of solver raised an exception: {0}".format(e))
+            print("cmd = {0}".format(solver_cmd))
+        if stream_reader is not None:
+            stream_reader.join()
+            if stream_errors and not result.timeout and return_code == 0:
                 raise SimulationError(
-                    "Solver execution failed, return code = {0}".format(return_code))
+                    "Reading the solver output stream failed: {0}".format(stream_errors[0]))
 
-            result.success = True
-            if profile:
-                self.read_profile_info(result)
-            if stdout is not None:
-                result.stdout = stdout.decode('utf-8')
-            if stderr is not None:
-                result.stderr = stderr.decode('utf-8')
-            if number_of_trajectories > 1:
-                result_list.append(result)
-            else:
-                return result
+        if return_code is not None and return_code != 0:
+            if self.debug_level >= 1:
+                try:
+                    print(stderr)
+                    print(stdout)
+                except Exception as e:
+                    pass
+            print("solver_cmd = {0}".format(solver_cmd))
+            raise SimulationError(
+                "Solver execution failed, return code = {0}".format(return_code))
 
-        return result_list
+        result.success = True
+        if profile:
+            self.read_profile_info(result)
+        if stdout is not None:
+            result.stdout = stdout.decode('utf-8')
+        if stderr is not None:
+            result.stderr = stderr.decode('utf-8')
+        return result
 
     def read_profile_info(self, result):
         profile_data_path = os.path.join(result.result_dir, 'gmon.out')
-        exe_path = os.path.join(self.build_dir, self.executable_name)
+        exe_path = self.executable_path
         cmd = f'gprof {exe_path} {profile_data_path}'
         print(cmd)
         proc = subprocess.Popen(cmd, shell=True, stdout=subprocess.PIPE)
@@ -283,17 +736,20 @@ class Solver:
             "__NUMBER_OF_REACTIONS__", str(self.model.get_num_reactions()))
         propfilestr = propfilestr.replace(
             "__NUMBER_OF_SPECIES__", str(self.model.get_num_species()))
-        propfilestr = propfilestr.replace(
-            "__NUMBER_OF_VOXELS__", str(self.model.mesh.get_num_voxels()))
 
-        # Make sure all paramters are evaluated to scalars before we write them to the file.
-        self.model.resolve_parameters()
-        parameters = ""
-        for p in self.model.listOfParameters:
-            parameters += "const double " + p + " = " + \
-                str(self.model.listOfParameters[p].value) + ";\n"
+        # The parameter values are written to the input file (or given on the command
+        # line), so the generated code does not change when only the values change.
+        # They are variables rather than macros of input_parameters, so a parameter
+        # name does not replace the identifiers of the template.
+        parameters = "#define NUM_PARAMETERS {0}\n".format(len(self.model.listOfParameters))
+        load_parameters = ""
+        for i, p in enumerate(self.model.listOfParameters):
+            parameters += "static double {0};\n".format(p)
+            load_parameters += "    {0} = input_parameters[{1}];\n".format(p, i)
         propfilestr = propfilestr.replace(
             "__DEFINE_PARAMETERS__", str(parameters))
+        propfilestr = propfilestr.replace(
+            "__LOAD_PARAMETERS__", load_parameters)
 
         # Reactions
         funheader = "double __NAME__(const int *x, double t, const double vol, const double *data_fn, int sd)"
@@ -381,37 +837,12 @@ class Solver:
 
         # End of pyurdme replacements
         # SSA-SDPD values here
-        init_particles = ""
-        if self.model.mesh.type is None:
-            self.model.mesh.type = numpy.ones(self.model.mesh.get_num_voxels())
-        for i in range(len(self.model.mesh.type)):
-            if self.model.mesh.type[i] == 0:
-                raise SimulationError(
-                    "Not all particles have been defined in a type. Mass and other properties must be defined")
-            init_particles += "init_create_particle(sys,id++,{0},{1},{2},{3},{4},{5},{6},{7},{8});".format(
-                self.model.mesh.coordinates()[i,0],self.model.mesh.coordinates()[i,1],self.model.mesh.coordinates()[i,2],
-                self.model.mesh.type[i],self.model.mesh.nu[i],self.model.mesh.mass[i],
-                (self.model.mesh.mass[i] / self.model.mesh.vol[i]),int(self.model.mesh.fixed[i]),num_chem_species )+"\n"
-        propfilestr = propfilestr.replace("__INIT_PARTICLES__", init_particles)
-
-        # process initial conditions here
-        self.model.apply_initial_conditions()
-        nspecies = self.model.u0.shape[0]
-        ncells = self.model.u0.shape[1]
+        # The particles and initial condition are read from a binary file at startup,
+        # so the size of the generated source does not depend on the size of the mesh
+        self.create_input_file(os.path.join(os.path.dirname(os.path.abspath(file_name)), 'particles.bin'))
 
         input_constants = ""
 
-        outstr = "unsigned int input_u0[{0}] = ".format(nspecies*ncells)
-        outstr += "{"
-        if len(self.model.listOfSpecies) > 0:
-            for i in range(ncells):
-                for s in range(nspecies):
-                    if i+s > 0:
-                        outstr += ','
-                    outstr += str(int(self.model.u0[s, i]))
-        outstr += "};"
-        input_constants += outstr + "\n"
-
         data_fn_defs = ""
         if len(self.model.listOfSpecies) > 0:
             for ndf in range(len(self.model.listOfDataFunctions)):
@@ -423,17 +854,7 @@ class Solver:
         if len(self.model.listOfSpecies) > 0:
             N = self.model.create_stoichiometric_matrix()
             if(min(N.shape) > 0):
-                Nd = N.todense() # this will not work if Nrxn or Nspecies is zero
-                outstr = "static int input_N_dense[{0}] = ".format(
-                    Nd.shape[0] * Nd.shape[1])
-                outstr += "{"
-                for i in range(Nd.shape[0]):
-                    for j in range(Nd.shape[1]):
-                        if j+i > 0:
-                            outstr += ','
-                        outstr += "{0}".format(Nd[i, j])
-                outstr += "};\n"
-                outstr += "static size_t input_irN[{0}] = ".format(len(N.indices))
+                outstr = "static size_t input_irN[{0}] = ".format(len(N.indices))
                 outstr += "{"
                 for i in range(len(N.indices)):
                     if i > 0:
@@ -458,7 +879,6 @@ class Solver:
                 outstr += "};"
                 input_constants += outstr + "\n"
             else:
-                input_constants += "static int input_N_dense[0] = {};\n"
                 input_constants += "static size_t input_irN[0] = {};\n"
                 input_constants += "static size_t input_jcN[0] = {};\n"
                 input_constants += "static int input_prN[0] = {};\n"
@@ -524,7 +944,9 @@ class Solver:
         system_config += "system->static_domain = {0};\n".format(int(self.model.staticDomain))
         if(len(self.model.listOfSpecies) > 0):
             system_config += "system->subdomain_diffusion_matrix = input_subdomain_diffusion_matrix;\n"
-            system_config += "system->stoichiometric_matrix = input_N_dense;\n"
+            system_config += "system->stoich_irN = input_irN;\n"
+            system_config += "system->stoich_jcN = input_jcN;\n"
+            system_config += "system->stoich_prN = input_prN;\n"
             system_config += "system->chem_rxn_rhs_functions = ALLOC_ChemRxnFun();\n"
             system_config += "system->stoch_rxn_propensity_functions = ALLOC_propensities();\n"
             system_config += "system->species_names = input_species_names;\n";
@@ -532,26 +954,26 @@ class Solver:
         system_config += "system->dt = {0};\n".format(self.model.timestep_size)
         system_config += "system->nt = {0};\n".format(self.model.num_timesteps)
         system_config += "system->output_freq = {0};\n".format(self.model.output_freq)
-        if self.h is None:
-            self.h = self.model.mesh.find_h()
-        if self.h == 0.0:
-            raise ModelError('h (basis function width) can not be zero.')
-        system_config +="system->h = {0};\n".format(self.h)
-        system_config +="system->rho0 = {0};\n".format(self.model.mesh.rho0)
-        system_config +="system->c0 = {0};\n".format(self.model.mesh.c0)
-        system_config +="system->P0 = {0};\n".format(self.model.mesh.P0)
-        #// bounding box
-        system_config += "system->xlo = {0};\n".format(self.model.mesh.xlim[0])
-        system_config += "system->xhi = {0};\n".format(self.model.mesh.xlim[1])
-        system_config += "system->ylo = {0};\n".format(self.model.mesh.ylim[0])
-        system_config += "system->yhi = {0};\n".format(self.model.mesh.ylim[1])
-        system_config += "system->zlo = {0};\n".format(self.model.mesh.zlim[0])
-        system_config += "system->zhi = {0};\n".format(self.model.mesh.zlim[1])
-        #
-        if self.model.mesh.gravity is not None:
-            for i in range(3):
-                system_config += "system->gravity[{0}] = {1};\n".format(i,self.model.mesh.gravity[i])
-
+        if self.model.adaptive_timestep:
+            system_config += "system->adaptive_dt = 1;\n"
+            if self.model.max_timestep is not None:
+                system_config += "system->dt_max = {0};\n".format(self.model.max_timestep)
+        if self.model.rdme_steps != 1:
+            system_config += "system->rdme_steps = {0};\n".format(self.model.rdme_steps)
+        if self.model.chemistry_substeps != 1:
+            system_config += "system->chem_substeps = {0};\n".format(self.model.chemistry_substeps)
+        if self.model.implicit_diffusion:
+            if not self.model.staticDomain:
+                raise SimulationError("Implicit diffusion is only supported in static domains")
+            system_config += "system->implicit_diffusion = 1;\n"
+        if self.model.chemistry_integrator == "rosenbrock":
+            system_config += "system->chem_integrator = CHEM_INTEGRATOR_ROSENBROCK;\n"
+        if self.model.reduction_freq is not None:
+            system_config += "system->reduction_freq = {0};\n".format(self.model.reduction_freq)
+            if self.model.reduction_axis is not None:
+                system_config += "system->reduction_axis = {0};\n".format(self.model.reduction_axis)
+                system_config += "system->reduction_nbins = {0};\n".format(self.model.reduction_bins)
+        # h, the fluid constants, the bounding box and gravity are in the input file
 
         propfilestr = propfilestr.replace("__SYSTEM_CONFIG__", system_config)
 
@@ -575,6 +997,56 @@ class Solver:
         propfile.close()
 
 
+    def get_particle_arrays(self):
+        """ The particles, the initial condition and the default parameter values of the model
+        as contiguous numpy arrays in the layout used by the solver: 'domain' (h, rho0, c0,
+        P0, the bounding box and gravity, see set_system_domain()), 'parameters', 'x'
+        (num_particles x 3), 'nu', 'mass', 'rho', 'type', 'solid_tag' (int32) and 'u0'
+        (uint32, num_particles x num_species). """
+        if self.model.mesh.type is None:
+            self.model.mesh.type = numpy.ones(self.model.mesh.get_num_voxels())
+        if (self.model.mesh.type == 0).any():
+            raise SimulationError(
+                "Not all particles have been defined in a type. Mass and other properties must be defined")
+        # process initial conditions here
+        self.model.apply_initial_conditions()
+        # Make sure all paramters are evaluated to scalars before we write them to the file.
+        self.model.resolve_parameters()
+        if self.h is None:
+            self.h = self.model.mesh.find_h()
+        if self.h == 0.0:
+            raise ModelError('h (basis function width) can not be zero.')
+        mesh = self.model.mesh
+        gravity = [0.0, 0.0, 0.0] if mesh.gravity is None else list(mesh.gravity)
+        domain = [self.h, mesh.rho0, mesh.c0, mesh.P0] + list(mesh.xlim) + list(mesh.ylim) + list(mesh.zlim) + gravity
+        parameters = [self.model.listOfParameters[p].value for p in self.model.listOfParameters]
+        num_particles = len(self.model.mesh.type)
+        mass = numpy.ascontiguousarray(self.model.mesh.mass, dtype=numpy.float64)
+        return {
+            'domain': numpy.array(domain, dtype=numpy.float64),
+            'parameters': numpy.array(parameters, dtype=numpy.float64),
+            'x': numpy.ascontiguousarray(self.model.mesh.coordinates()[:num_particles, :3], dtype=numpy.float64),
+            'nu': numpy.ascontiguousarray(self.model.mesh.nu, dtype=numpy.float64),
+            'mass': mass,
+            'rho': mass / numpy.asarray(self.model.mesh.vol, dtype=numpy.float64),
+            'type': numpy.asarray(self.model.mesh.type, dtype=numpy.float64).astype(numpy.int32),
+            'solid_tag': numpy.asarray(self.model.mesh.fixed).astype(numpy.int32),
+            'u0': numpy.ascontiguousarray(self.model.u0.T, dtype=numpy.uint32),
+        }
+
+    def create_input_file(self, file_name):
+        """ Write the particles and the initial condition of the model to the binary input
+        file read by the solver (see read_particle_input_file.c for the format). """
+        # in-process runs (load_library) use the same particles and initial condition
+        arrays = self.particle_arrays = self.get_particle_arrays()
+        num_particles, num_species = arrays['u0'].shape
+        with open(file_name, 'wb') as fd:
+            fd.write(b'SPDINPT2')
+            fd.write(numpy.array([num_particles, num_species, len(arrays['parameters']), 0], dtype=numpy.uint32).tobytes())
+            for name in ['domain', 'parameters', 'x', 'nu', 'mass', 'rho', 'type', 'solid_tag', 'u0']:
+                fd.write(arrays[name].tobytes())
+
+
 class SimulationError(Exception):
     pass
 
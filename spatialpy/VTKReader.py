@@ -1,5 +1,6 @@
 import numpy
 import math
+import re
 
 
 class VTKReader:
@@ -19,6 +20,11 @@ class VTKReader:
             "float": "float32",
             "double": "float64",
         }
+        # Section header lines of the legacy format: 'POINTS n type', 'VERTICES n size',
+        # 'POINT_DATA n', 'FIELD name n' and 'name components tuples type' arrays.
+        # The leading newline lets the regex engine skip quickly over the numeric data.
+        self.sectionheader = re.compile(
+            rb'\n((?:POINTS|VERTICES|POINT_DATA|FIELD) [^\n]*|[^\s\d.+-]\S* \d+ \d+ (?:int|float|double)[ \t\r]*)(?=\n)')
 
     def setfilename(self, filename):
         """Set filename.
@@ -54,152 +60,62 @@ class VTKReader:
         """Get (list) points."""
         return self.points
 
-    def isvalidnum(self, numstr):
-        """Test if string is a valid numeric value.
+    def readnumeric(self, data, count, dtype):
+        """Parse a block of whitespace separated numeric data.
         Args:
-            (str) string to test
+            (bytes) ASCII data
+            (int) number of values expected
+            (str) numpy dtype
         Return:
-            (boolean) True/False
+            (numpy array) of (numpy) dtype
         """
 
-        try:
-            float(numstr)
-        except:
-            return False
-
-        return True
-
-    def readnumeric(self, fd):
-        """Read numeric data to be returned in a list.
-        Args:
-            file descriptor
-        Return:
-            (list) numeric data read"""
-
-        numericlist = []
-
-        for line in fd:
-            #print('line={0}'.format(line))
-            l = line.strip().split()
-            if(len(l)==0):
-                break
-            if self.isvalidnum(l[0]):
-                numericlist.extend(l)
-            else:
-                break
-
-        return numericlist
-
-    def readpoints(self, fd, row, col, datatype):
-        """Read numeric data to be returned in a shaped numpy array.
-        Args:
-            file descriptor
-            (int) number of rows
-            (int) number of columns
-            (str) VTK datatype
-        Return:
-            (numpy array) of shape row by col of (numpy) dtype
-        """
-
-        pointlist = numpy.array(self.readnumeric(fd), dtype=self.datatypes[datatype])
-        if col > 1:
-            pointlist = pointlist.reshape(row, col)
-
-        return pointlist
-
-    # This should be refactored at some point and probably eliminated
-    # In factor of readnumeric()
-    def populatearrays(self, vtkdata, arraydata, col, row, name, datatype):
-        """Populate arrays with data to be added to dict of shaped arrays.
-        Args:
-            (dict) array data
-            (array) array data to be added to dict
-            (int) number of rows
-            (int) number of columns
-            (str) name of dict key
-            (str) VTK datatype
-        """
-
-        array = numpy.array(arraydata, dtype=datatype)
-        if col > 1:
-            array = array.reshape(row, col)
-        vtkdata[name] = array
-
-    def readarrays(self, fd):
-        """Read all arrays and data in file.
-        Args:
-            file descriptor
-        Return:
-            (dict) array data
-        """
-        vtkdata = {}
-        arraydata = []
-
-        for line in fd:
-            #if self.debug: print("line={0}".format(line),end='')
-            if line.isspace():
-                continue
-            try:
-                name, col, row, datatype = line.strip().split()
-                # got another PointData section
-            except Exception as e:
-                print("Error: {1}".format(e))
-                print("on line >>>")
-                print(line, end='')
-                print("<<< {0}".format(fd.tell()))
-                raise e
-            col = int(col)
-            row = int(row)
-
-            # now read row*col number of values
-            arraydata = []
-            while len(arraydata) < row*col:
-                line = fd.readline()
-                arraydata.extend(line.strip().split())
-
-            #if self.debug: print("populatearrays(name={0})".format(name))
-            self.populatearrays(vtkdata, arraydata, col, row, name, datatype)
-
-        return vtkdata
+        dtype = numpy.dtype(dtype)
+        if count == 0:
+            return numpy.zeros(0, dtype=dtype)
+        # Parse at full precision and convert, as numpy does for lists of strings
+        parsetype = "int64" if dtype.kind in "iu" else "float64"
+        values = numpy.fromstring(data, dtype=parsetype, sep=' ')
+        if values.size != count:
+            raise VTKReaderIOError("{0}: expected {1} values, found {2}.".format(
+                self.filename, count, values.size))
+        return values.astype(dtype, copy=False)
 
     def readfile(self):
         """Read VTK file."""
 
-        with open(self.filename) as fd:
+        with open(self.filename, 'rb') as fd:
             if self.debug: print("open({0})".format(self.filename))
-            tmp =  fd.readline()
-            #if self.debug:  print("line={0}".format(tmp),end='')
-            tmp =  fd.readline()
-            #if self.debug:  print("line={0}".format(tmp),end='')
-
-            # We only output ASCII so we can ignore BINARY
-            tmp =  fd.readline()
-            #if self.debug: print("line={0}".format(tmp),end='')
-            if tmp.strip().upper() != "ASCII":
-                raise VTKReaderIOError("{0} doesn't look like a valid ASCII VTK file.".format(self.filename))
-
-            tmp =  fd.readline()
-            #if self.debug:  print("line={0}".format(tmp),end='')
-
-            tmp =  fd.readline()
-            #if self.debug: print("line={0}".format(tmp),end='')
-            _, self.numpoints, self.pointdatatype = tmp.strip().split()
-            self.numpoints = int(self.numpoints)
-
-            #if self.debug: print("self.readpoints(numpoints={0})".format(self.numpoints),end='')
-            self.points = self.readpoints(fd, self.numpoints, 3, self.pointdatatype)
-            #if self.debug: print("self.points.shape = {0}".format(self.points.shape))
-
-            for line in fd:
-                if line[:5] != "FIELD":
-                    #print("skipping line: {0}".format(line),end='')
-                    continue
-                else:
-                    #if self.debug:  print("break skipping on line: {0}".format(line),end='')
-                    break
-
-            self.arrays = self.readarrays(fd)
-            #if self.debug: print("self.arrays.keys = {0}".format(self.arrays.keys()))
+            data = fd.read()
+
+        # Header: version, title, format, dataset type
+        header = data.split(b'\n', 4)
+        # We only output ASCII so we can ignore BINARY
+        if len(header) < 5 or header[2].strip().upper() != b"ASCII":
+            raise VTKReaderIOError("{0} doesn't look like a valid ASCII VTK file.".format(self.filename))
+        offset = len(data) - len(header[4]) - 1
+
+        # The numeric data of each section lies between its header line and the next one
+        sections = list(self.sectionheader.finditer(data, offset))
+        self.arrays = {}
+        for i, section in enumerate(sections):
+            end = sections[i+1].start() if i+1 < len(sections) else len(data)
+            block = data[section.end():end]
+            line = section.group(1).decode().split()
+            if line[0] == "POINTS":
+                self.numpoints = int(line[1])
+                self.pointdatatype = line[2]
+                self.points = self.readnumeric(block, 3*self.numpoints, self.datatypes[self.pointdatatype])
+                self.points = self.points.reshape(self.numpoints, 3)
+            elif len(line) == 4 and line[3] in self.datatypes:
+                name, col, row, datatype = line
+                col = int(col)
+                row = int(row)
+                # arrays use numpy's reading of the type name ('int' is int64)
+                array = self.readnumeric(block, row*col, datatype)
+                if col > 1:
+                    array = array.reshape(row, col)
+                self.arrays[name] = array
 
 
 class VTKReaderError(Exception):
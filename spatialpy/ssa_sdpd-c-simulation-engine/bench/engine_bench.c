@@ -0,0 +1,487 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+// Benchmarks of the engine hot paths on synthetic particle lattices, built by
+// 'make bench' (see build/Makefile).  Each kernel is timed on its own, over
+// all particles of the lattice, and the best of the repeats is written to
+// stdout as one JSON object per line:
+//   {"kernel": "find_neighbors", "lattice": "3d_uniform", "num_particles": 1000,
+//    "repeats": 3, "seconds": ..., "items": 1000, "ns_per_item": ...}
+// 'items' are particles, except for the nsm_* kernels where they are RDME events.
+//
+// Lattices are regular grids on [-1,1]^d, '_clustered' ones squeeze the grid
+// towards the center so the number of neighbors varies by up to 2^d.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chem_diffusion.h"
+#include "diffusion_masks.h"
+#include "linked_list.h"
+#include "model.h"
+#include "output.h"
+#include "particle.h"
+#include "propensities.h"
+#include "run_report.h"
+#include "simulate_rdme.h"
+#include "dSFMT/dSFMT.h"
+
+int debug_flag;
+dsfmt_t dsfmt;
+
+void applyBoundaryConditions(particle_t* me, system_t* system){
+}
+
+#define BENCH_NEIGHBORS_PER_SPACING 2.5  // support radius h in lattice spacings
+#define BENCH_DIFFUSION 1e-2
+#define BENCH_RATE 10.0
+#define BENCH_MOLECULES 10  // initial molecules of each species per particle
+
+typedef struct {
+    int dimension;
+    int clustered;
+    size_t num_particles;
+    double spacing;
+    double* x;
+} lattice_t;
+
+static lattice_t* create_lattice(const char*name, size_t num_particles){
+    lattice_t* l = (lattice_t*) malloc(sizeof(lattice_t));
+    if(strncmp(name, "2d_", 3) == 0){
+        l->dimension = 2;
+    }else if(strncmp(name, "3d_", 3) == 0){
+        l->dimension = 3;
+    }else{
+        printf("Error: unknown lattice '%s'\n", name);
+        exit(1);
+    }
+    if(strcmp(name+3, "uniform") == 0){
+        l->clustered = 0;
+    }else if(strcmp(name+3, "clustered") == 0){
+        l->clustered = 1;
+    }else{
+        printf("Error: unknown lattice '%s'\n", name);
+        exit(1);
+    }
+    size_t side = (size_t) ceil(pow((double)num_particles, 1.0/l->dimension) - 1e-9);
+    if(side < 2){ side = 2; }
+    l->num_particles = (l->dimension == 2) ? side*side : side*side*side;
+    l->spacing = 2.0/(side-1);
+    l->x = (double*) malloc(sizeof(double)*3*l->num_particles);
+    size_t i;
+    int k;
+    for(i=0; i<l->num_particles; i++){
+        size_t ndx[3] = {i % side, (i/side) % side, (l->dimension == 3) ? i/(side*side) : 0};
+        for(k=0; k<3; k++){
+            double u = (k < l->dimension) ? -1.0 + ndx[k]*l->spacing : 0.0;
+            l->x[3*i+k] = l->clustered ? 0.5*u*(1.0 + fabs(u)) : u;
+        }
+    }
+    return l;
+}
+
+static void destroy_lattice(lattice_t* l){
+    free(l->x);
+    free(l);
+}
+
+/* Networks of the nsm_* kernels: 'diffusion' has one species and no
+   reactions, 'reactions' converts A <-> B at a rate that makes most of
+   the events reactions. */
+static double bench_rxn_forward(const unsigned int *x, double t, const double vol, const double *data_fn, int sd){
+    return BENCH_RATE*x[0];
+}
+static double bench_rxn_backward(const unsigned int *x, double t, const double vol, const double *data_fn, int sd){
+    return BENCH_RATE*x[1];
+}
+static const double bench_diffusion_matrix[2] = {BENCH_DIFFUSION, 0.01*BENCH_DIFFUSION};
+static size_t diffusion_irN[1] = {0};
+static size_t diffusion_jcN[1] = {0};
+static int diffusion_prN[1] = {0};
+static size_t diffusion_irG[1] = {0};
+static size_t diffusion_jcG[2] = {0, 0};
+static size_t reactions_irN[4] = {0, 1, 0, 1};
+static size_t reactions_jcN[3] = {0, 2, 4};
+static int reactions_prN[4] = {-1, 1, 1, -1};
+static size_t reactions_irG[6] = {0, 1, 0, 1, 0, 1};
+static size_t reactions_jcG[5] = {0, 1, 2, 4, 6};
+static const char* const bench_species_names[] = {"A", "B", 0};
+
+// A system of the lattice with num_species stochastic species and the
+// sorted position index, num_species 2 adds the A <-> B reactions
+static system_t* create_bench_system(lattice_t* l, size_t num_species, size_t num_chem_species, unsigned int** u0){
+    size_t num_rxns = (num_species == 2) ? 2 : 0;
+    size_t n = l->num_particles;
+    size_t i;
+    system_t* system = create_system(1, num_chem_species, 0, num_species, num_rxns, 0);
+    system->dimension = l->dimension;
+    system->static_domain = 1;
+    system->dt = 1.0;
+    system->nt = 1;
+    system->h = BENCH_NEIGHBORS_PER_SPACING * l->spacing;
+    system->rho0 = 1.0;
+    system->c0 = 10.0;
+    system->P0 = 10.0;
+    system->xlo = -1.0; system->xhi = 1.0;
+    system->ylo = -1.0; system->yhi = 1.0;
+    system->zlo = (l->dimension == 3) ? -1.0 : 0.0;
+    system->zhi = (l->dimension == 3) ? 1.0 : 0.0;
+    system->species_names = bench_species_names;
+    system->subdomain_diffusion_matrix = bench_diffusion_matrix;
+    diffusion_masks__build(system);
+    if(num_rxns > 0){
+        system->stoch_rxn_propensity_functions = (PropensityFun*) malloc(sizeof(PropensityFun)*num_rxns);
+        system->stoch_rxn_propensity_functions[0] = bench_rxn_forward;
+        system->stoch_rxn_propensity_functions[1] = bench_rxn_backward;
+    }
+    int* type = (int*) malloc(sizeof(int)*n);
+    int* solid_tag = (int*) calloc(n, sizeof(int));
+    double* nu = (double*) malloc(sizeof(double)*n);
+    double* mass = (double*) malloc(sizeof(double)*n);
+    double* rho = (double*) malloc(sizeof(double)*n);
+    *u0 = (unsigned int*) malloc(sizeof(unsigned int)*n*num_species);
+    for(i=0; i<n; i++){
+        type[i] = 1;
+        nu[i] = 1e-2;
+        mass[i] = pow(l->spacing, l->dimension);
+        rho[i] = 1.0;
+    }
+    for(i=0; i<n*num_species; i++){
+        (*u0)[i] = BENCH_MOLECULES;
+    }
+    create_particles(system, n, num_species, l->x, type, nu, mass, rho, solid_tag, *u0);
+    free(type);
+    free(solid_tag);
+    free(nu);
+    free(mass);
+    free(rho);
+    linked_list_sort(system->x_index, 0);
+    return system;
+}
+
+static void find_all_neighbors(system_t* system){
+    node_t*n;
+    for(n=system->particle_list->head; n!=NULL; n=n->next){
+        find_neighbors(n->data, system);
+    }
+}
+
+typedef struct {
+    const char* lattice;
+    size_t num_particles;
+    int repeats;
+} bench_run_t;
+
+static void report(bench_run_t* run, const char*kernel, double seconds, double items){
+    printf("{\"kernel\": \"%s\", \"lattice\": \"%s\", \"num_particles\": %lu, \"repeats\": %i, "
+           "\"seconds\": %.6g, \"items\": %.0f, \"ns_per_item\": %.6g}\n",
+           kernel, run->lattice, (unsigned long)run->num_particles, run->repeats,
+           seconds, items, items > 0 ? 1e9*seconds/items : 0.0);
+    fflush(stdout);
+}
+
+static int kernel_selected(const char*kernels, const char*kernel){
+    if(kernels == NULL){
+        return 1;
+    }
+    size_t len = strlen(kernel);
+    const char* k;
+    for(k=kernels; (k = strstr(k, kernel)) != NULL; k += len){
+        if((k == kernels || k[-1] == ',') && (k[len] == ',' || k[len] == '\0')){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Kernels that only need the particles and their neighbors
+static void bench_particle_kernels(bench_run_t* run, lattice_t* l, const char*kernels, int num_output_threads){
+    unsigned int* u0;
+    system_t* system = create_bench_system(l, 1, 0, &u0);
+    initialize_rdme(system, diffusion_irN, diffusion_jcN, diffusion_prN, diffusion_irG, diffusion_jcG, u0);
+    size_t n = system->particle_list->count;
+    node_t* p;
+    int r;
+    double best, start;
+
+    best = -1.0;
+    for(r=0; r<run->repeats; r++){
+        start = run_timer__now();
+        find_all_neighbors(system);
+        double seconds = run_timer__now() - start;
+        if(best < 0.0 || seconds < best){ best = seconds; }
+    }
+    if(kernel_selected(kernels, "find_neighbors")){
+        report(run, "find_neighbors", best, n);
+    }
+
+    if(kernel_selected(kernels, "linked_list_sort")){
+        // the positions move by a fraction of the spacing between two sorts,
+        // as they do in one time step
+        best = -1.0;
+        for(r=0; r<run->repeats; r++){
+            for(p=system->x_index->head; p!=NULL; p=p->next){
+                p->data->x[0] += 0.1*l->spacing*(dsfmt_genrand_close_open(&dsfmt) - 0.5);
+            }
+            start = run_timer__now();
+            linked_list_sort(system->x_index, 0);
+            double seconds = run_timer__now() - start;
+            if(best < 0.0 || seconds < best){ best = seconds; }
+        }
+        report(run, "linked_list_sort", best, n);
+        size_t i;
+        for(i=0, p=system->particle_list->head; p!=NULL; p=p->next, i++){
+            p->data->x[0] = l->x[3*i];
+        }
+        linked_list_sort(system->x_index, 0);
+        find_all_neighbors(system);
+    }
+
+    if(kernel_selected(kernels, "pairwiseForce")){
+        best = -1.0;
+        for(r=0; r<run->repeats; r++){
+            start = run_timer__now();
+            for(p=system->particle_list->head; p!=NULL; p=p->next){
+                pairwiseForce(p->data, system);
+            }
+            double seconds = run_timer__now() - start;
+            if(best < 0.0 || seconds < best){ best = seconds; }
+        }
+        report(run, "pairwiseForce", best, n);
+    }
+
+    if(kernel_selected(kernels, "pairwiseForceFused")){
+        // the neighbor pass of compute_forces() on a step that filters the density
+        best = -1.0;
+        for(r=0; r<run->repeats; r++){
+            start = run_timer__now();
+            for(p=system->particle_list->head; p!=NULL; p=p->next){
+                pairwiseForceFused(p->data, system, FUSE_FILTER_DENSITY | FUSE_BOUNDARY_VOLUME_FRACTION);
+            }
+            double seconds = run_timer__now() - start;
+            if(best < 0.0 || seconds < best){ best = seconds; }
+        }
+        report(run, "pairwiseForceFused", best, n);
+    }
+
+    if(kernel_selected(kernels, "pairwiseForceWall")){
+        // the same step for particles that are all fixed walls
+        best = -1.0;
+        for(r=0; r<run->repeats; r++){
+            start = run_timer__now();
+            for(p=system->particle_list->head; p!=NULL; p=p->next){
+                pairwiseForceWall(p->data, system, 1);
+            }
+            double seconds = run_timer__now() - start;
+            if(best < 0.0 || seconds < best){ best = seconds; }
+        }
+        report(run, "pairwiseForceWall", best, n);
+    }
+
+    if(kernel_selected(kernels, "filterDensity")){
+        best = -1.0;
+        for(r=0; r<run->repeats; r++){
+            start = run_timer__now();
+            for(p=system->particle_list->head; p!=NULL; p=p->next){
+                filterDensity(p->data, system);
+            }
+            double seconds = run_timer__now() - start;
+            if(best < 0.0 || seconds < best){ best = seconds; }
+        }
+        report(run, "filterDensity", best, n);
+    }
+
+    if(kernel_selected(kernels, "computeBoundaryVolumeFraction")){
+        best = -1.0;
+        for(r=0; r<run->repeats; r++){
+            start = run_timer__now();
+            for(p=system->particle_list->head; p!=NULL; p=p->next){
+                computeBoundaryVolumeFraction(p->data, system);
+            }
+            double seconds = run_timer__now() - start;
+            if(best < 0.0 || seconds < best){ best = seconds; }
+        }
+        report(run, "computeBoundaryVolumeFraction", best, n);
+    }
+
+    if(kernel_selected(kernels, "output_vtk__async_step")){
+        // written to the working directory as output1.vtk and removed
+        system->num_output_threads = num_output_threads;
+        output_vtk__sync_step(system, 1);
+        best = -1.0;
+        for(r=0; r<run->repeats; r++){
+            start = run_timer__now();
+            output_vtk__async_step(system);
+            double seconds = run_timer__now() - start;
+            if(best < 0.0 || seconds < best){ best = seconds; }
+        }
+        unlink("output1.vtk");
+        report(run, "output_vtk__async_step", best, n);
+    }
+    destroy_system(system);
+    free(u0);
+}
+
+// The diffusion flux of one deterministic species in a static domain, by the
+// neighbor pass of pairwiseForce() and by the assembled operator, and one
+// implicit diffusion step of length 1 (BENCH_DIFFUSION*dt/h^2 of about 1e-3)
+static void bench_chem_diffusion(bench_run_t* run, lattice_t* l, const char*kernels){
+    unsigned int* u0;
+    system_t* system = create_bench_system(l, 1, 1, &u0);
+    size_t n = system->particle_list->count;
+    node_t* p;
+    int r;
+    double best, start;
+    find_all_neighbors(system);
+
+    if(kernel_selected(kernels, "pairwiseForce_chem")){
+        best = -1.0;
+        for(r=0; r<run->repeats; r++){
+            start = run_timer__now();
+            for(p=system->particle_list->head; p!=NULL; p=p->next){
+                pairwiseForce(p->data, system);
+            }
+            double seconds = run_timer__now() - start;
+            if(best < 0.0 || seconds < best){ best = seconds; }
+        }
+        report(run, "pairwiseForce_chem", best, n);
+    }
+
+    system->chem_diffusion = chem_diffusion__create(system);
+    if(kernel_selected(kernels, "chem_diffusion__add_flux")){
+        best = -1.0;
+        for(r=0; r<run->repeats; r++){
+            start = run_timer__now();
+            for(p=system->particle_list->head; p!=NULL; p=p->next){
+                chem_diffusion__add_flux(system->chem_diffusion, p->data, system);
+            }
+            double seconds = run_timer__now() - start;
+            if(best < 0.0 || seconds < best){ best = seconds; }
+        }
+        report(run, "chem_diffusion__add_flux", best, n);
+    }
+
+    if(kernel_selected(kernels, "chem_diffusion__solve_implicit")){
+        best = -1.0;
+        for(r=0; r<run->repeats; r++){
+            start = run_timer__now();
+            chem_diffusion__solve_implicit(system->chem_diffusion, system, 1.0);
+            double seconds = run_timer__now() - start;
+            if(best < 0.0 || seconds < best){ best = seconds; }
+        }
+        report(run, "chem_diffusion__solve_implicit", best, n);
+    }
+    destroy_system(system);
+    free(u0);
+}
+
+// nsm_core__take_step() with a step size of about one event per particle
+static void bench_nsm(bench_run_t* run, lattice_t* l, const char*kernel, size_t num_species){
+    unsigned int* u0;
+    system_t* system = create_bench_system(l, num_species, 0, &u0);
+    if(num_species == 2){
+        initialize_rdme(system, reactions_irN, reactions_jcN, reactions_prN, reactions_irG, reactions_jcG, u0);
+    }else{
+        initialize_rdme(system, diffusion_irN, diffusion_jcN, diffusion_prN, diffusion_irG, diffusion_jcG, u0);
+    }
+    find_all_neighbors(system);
+    nsm_core__initialize_rxn_propensities(system);
+    nsm_core__initialize_diff_propensities(system);
+    nsm_core__initialize_heap(system);
+    system->rdme->initialized = 1;
+    double total_rate = 0.0;
+    node_t* p;
+    for(p=system->particle_list->head; p!=NULL; p=p->next){
+        total_rate += p->data->rdme->srrate + p->data->rdme->sdrate;
+    }
+    double step_size = (double)system->particle_list->count / total_rate;
+    double t = 0.0, best = -1.0, best_events = 0.0;
+    int r;
+    for(r=0; r<run->repeats; r++){
+        long int events = system->rdme->total_reactions + system->rdme->total_diffusion;
+        double start = run_timer__now();
+        nsm_core__take_step(system, t, step_size);
+        double seconds = run_timer__now() - start;
+        t += step_size;
+        events = system->rdme->total_reactions + system->rdme->total_diffusion - events;
+        if(best < 0.0 || seconds < best){
+            best = seconds;
+            best_events = events;
+        }
+    }
+    report(run, kernel, best, best_events);
+    destroy_system(system);
+    free(u0);
+}
+
+static void usage(const char*name){
+    printf("Usage: %s [-n sizes] [-l lattices] [-k kernels] [-r repeats] [-t output_threads] [-s seed]\n", name);
+    printf("  -n  comma separated particle counts (default 1000,10000,100000)\n");
+    printf("  -l  comma separated lattices: 2d_uniform, 2d_clustered, 3d_uniform, 3d_clustered (default all)\n");
+    printf("  -k  comma separated kernels: find_neighbors, linked_list_sort, pairwiseForce, pairwiseForceFused,\n");
+    printf("      pairwiseForceWall, filterDensity, computeBoundaryVolumeFraction, output_vtk__async_step,\n");
+    printf("      pairwiseForce_chem, chem_diffusion__add_flux, chem_diffusion__solve_implicit, nsm_diffusion,\n");
+    printf("      nsm_reactions\n");
+    printf("      (default all)\n");
+    printf("  -r  repeats of each kernel, the fastest is reported (default 3)\n");
+}
+
+int main(int argc, char**argv){
+    const char* sizes = "1000,10000,100000";
+    const char* lattices = "2d_uniform,2d_clustered,3d_uniform,3d_clustered";
+    const char* kernels = NULL;
+    int repeats = 3;
+    int num_output_threads = 1;
+    long seed = 1;
+    int opt;
+    while((opt = getopt(argc, argv, "n:l:k:r:t:s:h")) != -1){
+        switch(opt){
+            case 'n': sizes = optarg; break;
+            case 'l': lattices = optarg; break;
+            case 'k': kernels = optarg; break;
+            case 'r': repeats = atoi(optarg); break;
+            case 't': num_output_threads = atoi(optarg); break;
+            case 's': seed = atol(optarg); break;
+            default: usage(argv[0]); exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    if(repeats < 1 || num_output_threads < 1){
+        usage(argv[0]);
+        exit(1);
+    }
+    debug_flag = 0;
+    dsfmt_init_gen_rand(&dsfmt, seed);
+    char* lattice_list = strdup(lattices);
+    char* lattice_save;
+    char* lattice_name;
+    for(lattice_name = strtok_r(lattice_list, ",", &lattice_save); lattice_name != NULL;
+        lattice_name = strtok_r(NULL, ",", &lattice_save)){
+        char* size_list = strdup(sizes);
+        char* size_save;
+        char* size;
+        for(size = strtok_r(size_list, ",", &size_save); size != NULL; size = strtok_r(NULL, ",", &size_save)){
+            lattice_t* l = create_lattice(lattice_name, strtoul(size, NULL, 10));
+            bench_run_t run = {lattice_name, l->num_particles, repeats};
+            bench_particle_kernels(&run, l, kernels, num_output_threads);
+            if(kernel_selected(kernels, "pairwiseForce_chem") || kernel_selected(kernels, "chem_diffusion__add_flux") ||
+               kernel_selected(kernels, "chem_diffusion__solve_implicit")){
+                bench_chem_diffusion(&run, l, kernels);
+            }
+            if(kernel_selected(kernels, "nsm_diffusion")){
+                bench_nsm(&run, l, "nsm_diffusion", 1);
+            }
+            if(kernel_selected(kernels, "nsm_reactions")){
+                bench_nsm(&run, l, "nsm_reactions", 2);
+            }
+            destroy_lattice(l);
+        }
+        free(size_list);
+    }
+    free(lattice_list);
+    return 0;
+}
@@ -0,0 +1,28 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#ifndef checkpoint_h
+#define checkpoint_h
+#include <signal.h>
+#include "particle.h"
+
+#define CHECKPOINT_FILENAME "checkpoint.bin"
+
+// Set to the signal number by SIGINT/SIGTERM, the main loop then writes a
+// checkpoint and exits
+extern volatile sig_atomic_t checkpoint_requested;
+
+void checkpoint__install_signal_handlers();
+// Copy the state at the start of 'step' (called by the output thread while
+// the main and worker threads are stopped)
+void checkpoint__sync_step(system_t*system, unsigned int step);
+// Write the copied state to CHECKPOINT_FILENAME
+void checkpoint__async_step(system_t*system);
+// Restore the state written by a previous run, sets system->start_step
+void checkpoint__restore(system_t*system, const char*filename);
+
+#endif // checkpoint_h
@@ -0,0 +1,48 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#ifndef chem_diffusion_h
+#define chem_diffusion_h
+#include "particle.h"
+
+// Diffusion of the deterministic species in a static domain.  The particles do not
+// move, so the flux pairwiseForce() takes from the neighbors of particle i,
+//   Q_i[s] += D_i[s] * sum_j w_ij * (C_i[s] - C_j[s])
+// with the pair weight w_ij of Tartakovsky et al. (2007), is a constant linear
+// operator.  Its weights are assembled once, after the neighbor search of the
+// first step, into one CSR matrix shared by all species (D_i[s] depends only on
+// the type of particle i and is applied per row, the pairs with a neighbor the
+// species does not diffuse into are left out, see diffusion_masks.h).
+struct __chem_diffusion_t {
+    size_t num_rows;  // one row per particle, by id
+    size_t* row_ptr;  // num_rows+1
+    unsigned int* col;  // particle id of the neighbor of each entry
+    double* w;  // w_ij of each entry
+    particle_t** particles;  // by id
+    double* work;  // 7*num_rows, for chem_diffusion__solve_implicit()
+};
+
+// Relative residual and iteration limit of the conjugate gradient solve
+#define CHEM_DIFFUSION_CG_TOLERANCE 1e-10
+#define CHEM_DIFFUSION_CG_MAX_ITERATIONS 1000
+
+chem_diffusion_t* chem_diffusion__create(system_t* system);
+void chem_diffusion__destroy(chem_diffusion_t* d);
+
+// Add the diffusion flux of particle 'me' to me->Q, one row of the SpMV.  Called
+// by the worker threads instead of the neighbor pass of pairwiseForce().
+void chem_diffusion__add_flux(const chem_diffusion_t* d, particle_t* me, system_t* system);
+
+// With system->implicit_diffusion: advance the concentrations of all species by
+// a backward Euler step of length dt of the diffusion alone, so the step size is
+// not limited by the diffusion constants.  Each species is one symmetric positive
+// definite system (rows scaled by 1/D_i, particles with D_i = 0 keep their
+// concentration and do not exchange with their neighbors), solved by conjugate
+// gradients with a Jacobi preconditioner.
+void chem_diffusion__solve_implicit(chem_diffusion_t* d, system_t* system, double dt);
+
+#endif //chem_diffusion_h
@@ -9,5 +9,8 @@ See the file LICENSE.txt for details.
 #define count_cores_h
 
 int get_num_processors();
+int get_num_affinity_processors();
+double get_cgroup_cpu_quota();
+int get_num_usable_processors();
 
 #endif //count_cores_h
@@ -0,0 +1,42 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#ifndef diffusion_masks_h
+#define diffusion_masks_h
+#include "particle.h"
+
+// Which species diffuse into particles of which type, from the
+// subdomain_diffusion_matrix of the model (species s, type t at
+// s*num_types + t-1: 0.0 where the species has no diffusion constant or
+// is restricted to other types by Model.restrict()).  Built once, so the
+// diffusion loops only visit the species that move instead of looking the
+// matrix up for every species and pair.
+struct __diffusion_masks_t {
+    size_t num_types;
+    size_t num_species;
+    // species with D > 0 in particles of type t+1 and their diffusion constant:
+    // species[k], D[k] for type_ptr[t] <= k < type_ptr[t+1]
+    size_t* type_ptr;
+    unsigned int* species;
+    double* D;
+    // by species: 1 if it diffuses into particles of every type, so the type
+    // of the neighbors need not be checked
+    unsigned char* everywhere;
+};
+
+// Build system->diffusion_masks, unless it is built or the model has no species.
+// Called before the first step and by the RDME, outside of the worker threads.
+void diffusion_masks__build(system_t* system);
+void diffusion_masks__destroy(diffusion_masks_t* m);
+
+// Whether species s diffuses into particles of the given type (types start at 1)
+static inline int diffusion_masks__allowed(const diffusion_masks_t* m, const system_t* system,
+                                           size_t s, int type){
+    return m->everywhere[s] || system->subdomain_diffusion_matrix[s * m->num_types + (type - 1)] > 0.0;
+}
+
+#endif //diffusion_masks_h
@@ -0,0 +1,77 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#ifndef dt_control_h
+#define dt_control_h
+#include "particle.h"
+
+// Adaptive time stepping (system->adaptive_dt): the size of each step is the
+// smallest of the stability limits of the fluid particles, of system->dt_max
+// (if set) and of the time left to the next output.  It can be larger than
+// the model's dt (system->dt_nominal) once the flow has settled.
+//   CFL:       dt <= DT_CFL_FACTOR * h / (c + max|v|), c = sqrt(DT_PRESSURE_FACTOR * P0 / rho0)
+//              the speed of the pressure waves of the equation of state
+//              P = P0 (rho/rho0 - 1) and of the background pressure force (10 P0)
+//   viscous:   dt <= DT_VISCOUS_FACTOR * h^2 / max(nu)
+//   force:     dt <= DT_FORCE_FACTOR * sqrt(h / max|F|)
+//   diffusion: dt <= DT_VISCOUS_FACTOR * h^2 / max(D) of the deterministic species,
+//              unless they diffuse implicitly (system->implicit_diffusion)
+// The first step is at most the model's dt and each step at most DT_GROWTH_FACTOR
+// times the one before.  Static domains and domains without fluid particles
+// do not move, they take steps of the model's dt.
+#define DT_CFL_FACTOR 0.03
+#define DT_PRESSURE_FACTOR 11.0
+#define DT_VISCOUS_FACTOR 0.125
+#define DT_FORCE_FACTOR 0.25
+#define DT_GROWTH_FACTOR 1.2
+// A stable step size below this fraction of dt_nominal ends the run with an
+// error: the flow is unstable and the steps would only get smaller
+#define DT_MIN_FACTOR 1e-6
+
+// Largest velocity, force and viscosity seen by one thread, only written by that thread
+typedef struct __dt_limits_t {
+    double max_v2;
+    double max_F2;
+    double max_nu;
+    unsigned int num_fluid;  // particles that move
+    char padding[64];  // keeps the limits of two threads off the same cache line
+} dt_limits_t;
+
+static inline void dt_limits__clear(dt_limits_t* limits){
+    limits->max_v2 = 0.0;
+    limits->max_F2 = 0.0;
+    limits->max_nu = 0.0;
+    limits->num_fluid = 0;
+}
+
+// Called for each particle after take_step2(), solid particles do not move
+static inline void dt_limits__accumulate(dt_limits_t* limits, const particle_t* p){
+    if(p->solidTag){
+        return;
+    }
+    limits->num_fluid++;
+    double v2 = p->v[0]*p->v[0] + p->v[1]*p->v[1] + p->v[2]*p->v[2];
+    double F2 = p->F[0]*p->F[0] + p->F[1]*p->F[1] + p->F[2]*p->F[2];
+    if(v2 > limits->max_v2){ limits->max_v2 = v2; }
+    if(F2 > limits->max_F2){ limits->max_F2 = F2; }
+    if(p->nu > limits->max_nu){ limits->max_nu = p->nu; }
+}
+
+static inline void dt_limits__fold(dt_limits_t* limits, const dt_limits_t* thread_limits){
+    if(thread_limits->max_v2 > limits->max_v2){ limits->max_v2 = thread_limits->max_v2; }
+    if(thread_limits->max_F2 > limits->max_F2){ limits->max_F2 = thread_limits->max_F2; }
+    if(thread_limits->max_nu > limits->max_nu){ limits->max_nu = thread_limits->max_nu; }
+    limits->num_fluid += thread_limits->num_fluid;
+}
+
+// Stable step size from the limits folded over all particles, at most
+// system->dt_max.  Returns 0 (and prints the error to stderr) if the flow is unstable.
+double dt_control__stable_dt(system_t* system, const dt_limits_t* limits);
+// Stable step size from the state of all particles, used before the first step
+double dt_control__initial_dt(system_t* system);
+
+#endif // dt_control_h
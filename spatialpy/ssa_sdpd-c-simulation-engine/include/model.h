@@ -16,9 +16,32 @@ void filterDensity(particle_t* me, system_t* system);
 
 void pairwiseForce(particle_t* me, system_t* system);
 
+// What pairwiseForceFused() computes in the neighbor pass of the forces, besides them
+#define FUSE_FILTER_DENSITY 1            // me->rho_filtered, as filterDensity() computes me->rho
+#define FUSE_BOUNDARY_VOLUME_FRACTION 2  // me->bvf_phi and me->normal, as computeBoundaryVolumeFraction()
+
+// pairwiseForce() that also takes the sums of the density filter and of the boundary
+// volume fraction, so the neighbors are only walked once per step.  The sums use the
+// neighbors' state between the force and the corrector substeps.
+void pairwiseForceFused(particle_t* me, system_t* system, int fuse);
+
+// pairwiseForceFused() of a fixed solid particle of a moving domain: only the
+// chemistry flux Q and, with filter_density, me->rho_filtered are computed.
+void pairwiseForceWall(particle_t* me, system_t* system, int filter_density);
+
 void computeBoundaryVolumeFraction(particle_t* me, system_t* system);
 
 void applyBoundaryVolumeFraction(particle_t* me, system_t* system);
 
+// Advance the concentrations by the chemical reactions alone over the step, in
+// system->chem_substeps steps of system->chem_integrator.  Only used if
+// chemRxnsSplit(), the reactions are then left out of the flux Q of pairwiseForce().
+void integrateChemRxns(particle_t* me, system_t* system);
+
+static inline int chemRxnsSplit(const system_t* system)
+{
+    return system->chem_substeps > 1 || system->chem_integrator != CHEM_INTEGRATOR_EXPLICIT;
+}
+
 
 #endif //model_h
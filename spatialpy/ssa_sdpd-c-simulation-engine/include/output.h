@@ -16,5 +16,8 @@ void output_csv(system_t*system, int current_step);
 void output_vtk__sync_step(system_t*system, int current_step);
 void output_vtk__async_step();
 
+void output_stream__open(system_t*system, const char*path);
+void output_stream__async_step(system_t*system);
+
 #endif // output_h
 
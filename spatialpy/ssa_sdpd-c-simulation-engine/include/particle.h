@@ -11,10 +11,26 @@ See the file LICENSE.txt for details.
 typedef struct __particle_t particle_t;
 typedef struct __system_t system_t;
 typedef struct __bond_t bond_t;
+typedef struct __reduction_t reduction_t;
+typedef struct __thread_pool_t thread_pool_t;
+typedef struct __run_report_t run_report_t;
+typedef struct __chem_diffusion_t chem_diffusion_t;
+typedef struct __diffusion_masks_t diffusion_masks_t;
 
+#include <stdio.h>
 #include "linked_list.h"
 #include "simulate_rdme.h"
 
+// The fields of a particle that its corrector step (and the boundary
+// conditions) write and the force computation of its neighbors reads
+typedef struct {
+    double v[3];
+    double vt[3];
+    double rho;
+    double nu;
+    double* C;
+} particle_state_t;
+
 struct __particle_t {
     unsigned int id;
     int type;
@@ -27,6 +43,7 @@ struct __particle_t {
     int solidTag;
     double bvf_phi;
     double normal[3];
+    double rho_filtered;  // Shepard filtered rho, from the neighbor pass of compute_forces()
     double F[3];
     double Frho;
     double Fbp[3];
@@ -36,18 +53,47 @@ struct __particle_t {
     unsigned int*xx; // populaion of discrete/stochastic species
     double *C;  // concentration of chem species
     double *Q;  // flux of chem species
+    // The predicted state, copied at the end of take_step1(): the neighbors
+    // read it in compute_forces() while this particle may already take its
+    // corrector step, see particle__publish()
+    particle_state_t published;
     // below here for simulation
     node_t* x_index;  // 
     neighbor_list_t*neighbors;
     rdme_voxel_t*rdme;  // RDME solver data
 };
 
+// How the chemical reactions of the deterministic species are integrated
+#define CHEM_INTEGRATOR_EXPLICIT 0    // explicit steps
+#define CHEM_INTEGRATOR_ROSENBROCK 1  // linearly implicit ROS2 steps, for stiff reactions
+
 struct __system_t {
     int dimension;
     double dt;
     unsigned int nt; 
     unsigned int current_step;
+    // Adaptive time stepping, see dt_control.h: dt is chosen before each step,
+    // the run ends at time nt*dt_nominal and outputs are at multiples of output_freq*dt_nominal
+    int adaptive_dt;
+    double dt_nominal;  // the model's dt
+    double dt_max;  // largest step, 0: limited by the stability limits and the output times only
+    double dt_next;  // stable step size of the next step, 0: not known yet
+    double time;  // simulated time at the start of the current step
+    // Multi-rate stepping: the RDME takes one step over every rdme_steps fluid
+    // steps (and before each output, reduction and checkpoint), the chemical
+    // reactions take chem_substeps steps in each fluid step
+    unsigned int rdme_steps;
+    unsigned int chem_substeps;
+    int chem_integrator;  // CHEM_INTEGRATOR_*, see integrateChemRxns()
+    unsigned int start_step;  // first step, non-zero after a restart from a checkpoint
     unsigned int output_freq;
+    unsigned int num_output_threads;
+    unsigned int reduction_freq;  // 0: no in-situ reductions
+    unsigned int reduction_axis;
+    unsigned int reduction_nbins;
+    reduction_t* reduction;
+    FILE* output_stream;  // binary snapshot stream, NULL: write VTK files
+    unsigned int checkpoint_freq;  // 0: checkpoint only on SIGINT/SIGTERM
     double xlo, xhi, ylo, yhi, zlo, zhi;
     double h;
     double c0;
@@ -74,10 +120,22 @@ struct __system_t {
     const char * const* species_names; 
 
     const double *subdomain_diffusion_matrix;
+    diffusion_masks_t* diffusion_masks;  // species that diffuse by type, see diffusion_masks.h
+    // Static domains: diffusion operator of the deterministic species, NULL until
+    // the end of the first step, see chem_diffusion.h
+    chem_diffusion_t* chem_diffusion;
+    int implicit_diffusion;  // backward Euler steps of the diffusion (static domains only)
     //int *stochic_matrix;
-    int *stoichiometric_matrix;
+    // Stoichiometry of the reactions in compressed sparse column form, one column
+    // per reaction: reaction rxn changes species stoich_irN[k] by stoich_prN[k]
+    // for stoich_jcN[rxn] <= k < stoich_jcN[rxn+1]
+    const size_t *stoich_irN;
+    const size_t *stoich_jcN;
+    const int *stoich_prN;
     double* gravity;
 
+    thread_pool_t* thread_pool;  // threads kept between runs, NULL before the first run
+    run_report_t* run_report;  // timing of the last run, NULL before the first run
 };
 
 //struct __bond_t {
@@ -94,6 +152,22 @@ system_t* create_system(size_t num_types, size_t num_chem_species, size_t num_ch
                          size_t num_stoch_species, size_t num_stoch_rxns,size_t num_data_fn);
 particle_t* create_particle(int id);
 void add_particle(particle_t* me, system_t* system);
+// Create and add num_particles particles from arrays in particle id order (x is
+// num_particles x 3, u0 is num_particles x num_species), does not keep the arrays.
+// The ids follow those of the particles already in the system.
+void create_particles(system_t*system, size_t num_particles, size_t num_species,
+                      const double*x, const int*type, const double*nu, const double*mass,
+                      const double*rho, const int*solidTag, const unsigned int*u0);
+// Number of values of the domain of a mesh, in the order: h, rho0, c0, P0,
+// xlo, xhi, ylo, yhi, zlo, zhi, gravity[3]
+#define SYSTEM_DOMAIN_SIZE 13
+// Set the kernel width, the fluid constants, the bounding box and gravity of
+// the system from SYSTEM_DOMAIN_SIZE values
+void set_system_domain(system_t*system, const double*domain);
+// Copy the state of the particle that its neighbors read, see particle_t.published
+void particle__publish(particle_t* me, system_t* system);
+// Free the system, its particles, its RDME solver and its threads
+void destroy_system(system_t*system);
 double particle_dist(particle_t* p1, particle_t*p2);
 double particle_dist_sqrd(particle_t* p1, particle_t*p2);
 
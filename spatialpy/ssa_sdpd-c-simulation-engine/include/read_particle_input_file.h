@@ -0,0 +1,25 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#ifndef read_particle_input_file_h
+#define read_particle_input_file_h
+#include "linked_list.h"
+#include "particle.h"
+
+// Create the particles of 'system' from the binary input file written by
+// Solver.create_input_file(), set its domain and copy the default parameter
+// values to 'parameters'.  Returns the initial condition u0 (num_species values per
+// particle), which stays mapped for the lifetime of the process.
+unsigned int* read_particle_input_file(const char*filename, system_t*system,
+                                       double*parameters, size_t num_parameters);
+
+// Overwrite 'parameters' with the comma separated list of values given on
+// the command line (-p).
+void read_parameter_values(const char*values, double*parameters, size_t num_parameters);
+
+
+#endif //read_particle_input_file_h
@@ -0,0 +1,33 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#ifndef reduction_h
+#define reduction_h
+#include "particle.h"
+
+// In-situ reductions: aggregate statistics computed by the worker threads
+// (one partial sum array per thread) and folded into one row of
+// 'reductions.csv' by the main thread.
+struct __reduction_t {
+    unsigned int num_threads;
+    size_t num_values;   // length of one partial sum array
+    size_t num_per_type; // values per type: count, rho, v[3] + species totals
+    size_t hist_offset;  // start of the histogram block
+    double** partial;    // [num_threads][num_values]
+    double* total;
+    double hist_lo;
+    double hist_hi;
+    FILE* fp;
+};
+
+void reduction__create(system_t*system, unsigned int num_threads);
+void reduction__destroy(system_t*system);
+void reduction__clear(system_t*system, unsigned int thread_id);
+void reduction__accumulate(particle_t*p, system_t*system, unsigned int thread_id);
+void reduction__write(system_t*system, unsigned int step);
+
+#endif // reduction_h
@@ -0,0 +1,28 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#ifndef rosenbrock_h
+#define rosenbrock_h
+#include <stddef.h>
+
+// Right hand side f = dy/dt of the ODE system at (y, t)
+typedef void (*rosenbrock_rhs_t)(void* data, const double* y, double t, double* f);
+
+// Size of the 'work' array of rosenbrock__step() for n unknowns, in doubles
+#define ROSENBROCK_WORK_SIZE(n) ((n) * (n) + 4 * (n))
+
+// One step of length h of the two stage, second order, L-stable Rosenbrock
+// method ROS2 (Verwer et al. 1999), y is updated in place:
+//   (I - g*h*J) k1 = f(y)
+//   (I - g*h*J) k2 = f(y + h*k1) - 2*k1
+//   y += 3/2*h*k1 + 1/2*h*k2,  g = 1 + 1/sqrt(2)
+// The Jacobian J is taken by forward differences, with n+2 evaluations of rhs
+// in all.  'pivot' holds n ints.  Returns 0, or -1 if I - g*h*J is singular.
+int rosenbrock__step(rosenbrock_rhs_t rhs, void* data, size_t n, double* y, double t, double h,
+                     double* work, int* pivot);
+
+#endif //rosenbrock_h
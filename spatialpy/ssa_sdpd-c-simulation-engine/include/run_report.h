@@ -0,0 +1,83 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#ifndef run_report_h
+#define run_report_h
+#include <time.h>
+#include "particle.h"
+
+#define RUN_REPORT_FILENAME "run_report.json"
+#define RUN_REPORT_REASON_SIZE 512
+
+// Phases of a step timed by the thread that runs them
+typedef enum {
+    RUN_PHASE_SORT,
+    RUN_PHASE_NEIGHBOR_SEARCH,
+    RUN_PHASE_TAKE_STEP1,       // without the neighbor search
+    RUN_PHASE_PAIRWISE_FORCE,   // compute_forces() without the neighbor search
+    RUN_PHASE_TAKE_STEP2,
+    RUN_PHASE_BARRIER_WAIT,
+    RUN_PHASE_RDME,
+    RUN_PHASE_DIFFUSION,        // implicit diffusion of the deterministic species
+    RUN_PHASE_OUTPUT_SYNC,
+    RUN_PHASE_OUTPUT_ASYNC,
+    RUN_NUM_PHASES
+} run_phase_t;
+
+// Timers and counters of one thread, only written by that thread
+typedef struct __run_timer_t {
+    double seconds[RUN_NUM_PHASES];
+    unsigned long neighbor_pairs;
+    char padding[64];  // keeps the timers of two threads off the same cache line
+} run_timer_t;
+
+// Per-phase timing of a run: one run_timer_t per worker thread followed by
+// those of the main, sort and output threads.  The NSM event counters are
+// taken from system->rdme at the start and the end of the run.
+struct __run_report_t {
+    unsigned int num_threads;  // worker threads
+    char threads_reason[RUN_REPORT_REASON_SIZE];  // why num_threads, see choose_num_threads()
+    run_timer_t* timers;
+    struct timespec start;
+    double wall_seconds;
+    unsigned int start_step;
+    unsigned int end_step;
+    double end_time;  // simulated time at the end of the run
+    long int rdme_reactions;
+    long int rdme_diffusions;
+    long int rdme_heap_updates;
+};
+
+#define RUN_TIMER_MAIN(report) (&(report)->timers[(report)->num_threads])
+#define RUN_TIMER_SORT(report) (&(report)->timers[(report)->num_threads+1])
+#define RUN_TIMER_OUTPUT(report) (&(report)->timers[(report)->num_threads+2])
+
+// Timer of the calling worker thread, NULL outside of a run
+extern __thread run_timer_t* run_timer__current;
+
+static inline double run_timer__now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+// Add the time since 'start' (from run_timer__now()) to 'phase', returns the current time
+static inline double run_timer__add(run_timer_t* timer, run_phase_t phase, double start){
+    double now = run_timer__now();
+    timer->seconds[phase] += now - start;
+    return now;
+}
+
+// Start the report of a run with num_threads workers, chosen for 'threads_reason',
+// replaces the report of an earlier run
+void run_report__begin(system_t*system, unsigned int num_threads, const char*threads_reason);
+void run_report__end(system_t*system, unsigned int end_step);
+void run_report__destroy(system_t*system);
+// Write the report of the last run as JSON, see Result.get_run_report()
+void run_report__write(system_t*system, const char*filename);
+
+#endif // run_report_h
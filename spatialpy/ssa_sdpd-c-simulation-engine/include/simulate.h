@@ -9,17 +9,49 @@ See the file LICENSE.txt for details.
 #define simulate_h
 #include "particle.h"
 
-void run_simulation(int num_threads, system_t* system);
+// Run the simulation from system->start_step to system->nt.  The threads are
+// created by the first run of a system and parked between runs.  The reason for
+// num_threads goes to the run report.  Returns 0, or -1 if the adaptive time
+// step became unstable and the run ended early.
+int run_simulation(int num_threads, system_t* system, const char* threads_reason);
+// Stop and join the threads of the system
+void thread_pool__destroy(system_t* system);
+// Pick the number of worker threads from the usable CPUs, the particle
+// count and a timed probe of the force computation; the reasoning is
+// written to 'report'
+int choose_num_threads(system_t* system, char* report, size_t report_size);
 
 
 void take_step(void*me, system_t*system, unsigned int step, unsigned int substep);
 
 unsigned int get_number_of_substeps();
+// Whether the worker threads wait for each other after a substep, and the
+// number of such waits in a step
+int substep_ends_phase(unsigned int substep);
+unsigned int get_number_of_phases();
 
 
 void take_step1(particle_t* me, system_t*system, unsigned int step);
 void take_step2(particle_t* me, system_t*system, unsigned int step);
 void compute_forces(particle_t* me, system_t*system, unsigned int step);
+// compute_forces() of a fixed solid particle of a moving domain
+void compute_forces_wall(particle_t* me, system_t*system, unsigned int step);
+
+// What a particle needs computed in a step.  The worker threads keep one work
+// list of their particles per role, built at the start of each run.
+typedef enum {
+    PARTICLE_ROLE_FLUID,   // moving particle: forces, density and chemistry
+    PARTICLE_ROLE_WALL,    // fixed solid particle of a moving domain: density filter and chemistry
+    PARTICLE_ROLE_STATIC,  // particle of a static domain: chemistry
+    PARTICLE_NUM_ROLES
+} particle_role_t;
+
+static inline particle_role_t particle_role(const particle_t* me, const system_t* system){
+    if(system->static_domain){
+        return PARTICLE_ROLE_STATIC;
+    }
+    return me->solidTag ? PARTICLE_ROLE_WALL : PARTICLE_ROLE_FLUID;
+}
 //void compute_bond_forces(bond_t* this_bond, system_t*system, unsigned int step);
 
 #endif // simulate_h
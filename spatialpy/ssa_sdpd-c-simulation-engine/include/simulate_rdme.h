@@ -47,6 +47,7 @@ struct __rdme_data_t {
 
     long int total_reactions;
     long int total_diffusion;
+    long int total_heap_updates;
     //char** species_names; //  system->species_names
 };
 
@@ -63,7 +64,7 @@ struct __rdme_voxel_t {
 
 void initialize_rdme(system_t*system, size_t *irN, size_t *jcN,int *prN,size_t *irG,size_t *jcG,
                         unsigned int*u0);
-void simulate_rdme(system_t*system, unsigned int step);
+void simulate_rdme(system_t*system, double t, double dt);
 void destroy_rdme(system_t*system);
 
 
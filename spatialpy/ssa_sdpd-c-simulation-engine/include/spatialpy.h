@@ -0,0 +1,61 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#ifndef spatialpy_h
+#define spatialpy_h
+#include <stddef.h>
+#include "particle.h"
+
+// C API of a compiled model.  Every generated model implements these functions,
+// its main() runs the simulation through them and the model built as a shared
+// library ('make shared') is driven in-process by spatialpy.EngineLibrary.
+//
+// Lifecycle: create_system, set_domain, add_particles, (set_parameters), initialize_rdme,
+// seed, run_simulation, (set_num_steps, run_simulation), (write_run_report),
+// destroy_system.  A system owns
+// its threads and barriers: they are created by its first run, park between
+// runs and are joined by destroy_system.  The random number generator, the
+// parameter values and the output buffers are global, so only one simulation
+// can run at a time in a process.
+
+// Create an empty system configured for the model
+system_t* spatialpy_create_system(void);
+// Set the domain of the mesh from SYSTEM_DOMAIN_SIZE values, see set_system_domain()
+void spatialpy_set_domain(system_t*system, const double*domain);
+// Add particles from arrays in particle id order: x is num_particles x 3 and
+// u0 (the initial condition) is num_particles x num_species.  The arrays are
+// copied, except u0 (see spatialpy_initialize_rdme).  Particles can be added in
+// several calls, their ids follow those of the earlier calls, but not after
+// initialize_rdme: its u0 holds the populations of all particles in id order.
+void spatialpy_add_particles(system_t*system, size_t num_particles, size_t num_species,
+                             const double*x, const int*type, const double*nu, const double*mass,
+                             const double*rho, const int*solid_tag, const unsigned int*u0);
+// Number of parameters of the model and their current values, in the order of
+// Model.listOfParameters.  Changed values are used from the next
+// initialize_rdme or run_simulation.
+size_t spatialpy_num_parameters(void);
+double* spatialpy_parameters(void);
+// Create the RDME solver.  u0 is used in place as the population of the
+// stochastic species, it must stay valid until the system is destroyed.
+void spatialpy_initialize_rdme(system_t*system, unsigned int*u0);
+void spatialpy_seed(long seed);
+// Set the last step of the simulation (system->nt)
+void spatialpy_set_num_steps(system_t*system, unsigned int num_steps);
+// Run the simulation from the current step to the last step.  A system can be
+// run again after raising the last step, the run continues from the step and
+// time where the previous one ended.  num_threads <= 0 chooses the
+// number of threads with choose_num_threads(), the run report records the
+// reason for the number of threads.  If stream_path is not NULL the
+// output is streamed there, otherwise VTK files are written to the working
+// directory.  Returns the number of threads used, or -1 if the simulation
+// became unstable (the error is printed) and ended early.
+int spatialpy_run_simulation(system_t*system, int num_threads, const char*stream_path);
+// Write the per-phase timing and event counts of the last run as JSON
+void spatialpy_write_run_report(system_t*system, const char*filename);
+void spatialpy_destroy_system(system_t*system);
+
+#endif // spatialpy_h
@@ -5,10 +5,15 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include "checkpoint.h"
 #include "count_cores.h"
+#include "output.h"
 #include "particle.h"
 #include "propensities.h"
+#include "read_particle_input_file.h"
+#include "run_report.h"
 #include "simulate.h"
+#include "spatialpy.h"
 #include "dSFMT/dSFMT.h"
 
 /* Species names */
@@ -18,13 +23,18 @@ __DEFINE_SPECIES__
 #define NR __NUMBER_OF_REACTIONS__  // Depricated, will remove in future version.
 #define NUM_REACTIONS __NUMBER_OF_REACTIONS__
 #define NUM_SPECIES __NUMBER_OF_SPECIES__
-#define NUM_VOXELS __NUMBER_OF_VOXELS__
 
 __DATA_FUNCTION_DEFINITIONS__
 
 
-/* Parameter definitions */
+/* Parameter definitions, the values are read at startup (see -p) */
 __DEFINE_PARAMETERS__
+double input_parameters[NUM_PARAMETERS > 0 ? NUM_PARAMETERS : 1];
+
+/* Copy the parameter values from input_parameters to the parameters */
+static void load_parameters(void){
+__LOAD_PARAMETERS__
+}
 
 /* Reaction definitions */
 __DEFINE_REACTIONS__
@@ -58,34 +68,8 @@ __INPUT_CONSTANTS__
 int debug_flag;
 dsfmt_t dsfmt;
 
-void init_create_particle(system_t* sys, int id, double x, double y, double z, int type, double nu, double mass, double rho, int solidTag, int num_chem_species){
-    particle_t* p = create_particle(id);
-    p->x[0] = x;
-    p->x[1] = y;
-    p->x[2] = z;
-    p->id = id;
-    p->type = type;
-    p->nu = nu;
-    p->mass = mass;
-    p->rho = rho;
-    p->solidTag = solidTag;
-    add_particle(p, sys);
-    if(num_chem_species > 0){
-        for(int i=0;i<num_chem_species;i++){
-            p->C[i] = (double) input_u0[id*num_chem_species+i];
-        }
-    }
-}
-
-
-int init_all_particles(system_t* sys){
-    int id=0;
-    __INIT_PARTICLES__
-    return id;
-}
-
-
-int main(int argc, char**argv){
+/* C API, see spatialpy.h */
+system_t* spatialpy_create_system(void){
     //debug_flag = 1;
     //system_t* system = create_system();
     // Fix particles in space
@@ -94,30 +78,88 @@ int main(int argc, char**argv){
     //system->dt = 1;
     //system->nt = 101;
     //system->output_freq = 1;
-    //system->h = 0.5;
-    //system->rho0 = 1.0;
-    //system->c0 = 10;
-    //system->P0 = 10;
-    // bounding box
-    //system->xlo = -5.1;
-    //system->xhi = 5.1;
-    //system->ylo = -1.1;
-    //system->yhi = 1.1;
-    //system->zlo = -1.1;
-    //system->zhi = 1.1;
+    // h, the fluid constants, the bounding box and gravity are set from the
+    // input file (spatialpy_set_domain()), so the mesh is not compiled in
     __SYSTEM_CONFIG__
-    // create all particles in system
-    init_all_particles(system);
-    // Setup chemical reaction system
+    return system;
+}
+
+void spatialpy_set_domain(system_t*system, const double*domain){
+    set_system_domain(system, domain);
+}
+
+void spatialpy_add_particles(system_t*system, size_t num_particles, size_t num_species,
+                             const double*x, const int*type, const double*nu, const double*mass,
+                             const double*rho, const int*solid_tag, const unsigned int*u0){
+    create_particles(system, num_particles, num_species, x, type, nu, mass, rho, solid_tag, u0);
+}
+
+size_t spatialpy_num_parameters(void){
+    return NUM_PARAMETERS;
+}
+
+double* spatialpy_parameters(void){
+    return input_parameters;
+}
+
+void spatialpy_initialize_rdme(system_t*system, unsigned int*input_u0){
+    // the initial propensities use the parameter values
+    load_parameters();
     //initialize_rdme(system, NUM_VOXELS, NUM_SPECIES, NUM_REACTIONS, input_vol, input_sd,
     //                input_data, input_dsize, input_irN, input_jcN, input_prN, input_irG,
     //                input_jcG, input_species_names, input_u0, input_num_subdomain,
     //                input_subdomain_diffusion_matrix);
     __INIT_RDME__
+}
+
+void spatialpy_seed(long seed){
+    // dsfmt_init_gen_rand() does not overwrite all of the state when optimized
+    // (dSFMT.c type puns the state), start from the zeroed state of a new
+    // process so a seed gives the same numbers in every run
+    memset(&dsfmt, 0, sizeof(dsfmt));
+    dsfmt_init_gen_rand(&dsfmt, seed);
+}
+
+void spatialpy_set_num_steps(system_t*system, unsigned int num_steps){
+    system->nt = num_steps;
+}
+
+int spatialpy_run_simulation(system_t*system, int num_threads, const char*stream_path){
+    char thread_report[RUN_REPORT_REASON_SIZE];
+    if(num_threads <= 0){
+        num_threads = choose_num_threads(system, thread_report, sizeof(thread_report));
+    }else{
+        snprintf(thread_report, sizeof(thread_report), "set by the caller");
+    }
+    load_parameters();
+    system->num_output_threads = num_threads;
+    if(stream_path != NULL){
+        output_stream__open(system, stream_path);
+    }
+    if(run_simulation(num_threads, system, thread_report) != 0){
+        return -1;
+    }
+    return num_threads;
+}
+
+void spatialpy_write_run_report(system_t*system, const char*filename){
+    run_report__write(system, filename);
+}
+
+void spatialpy_destroy_system(system_t*system){
+    destroy_system(system);
+}
+
+int main(int argc, char**argv){
+    system_t* system = spatialpy_create_system();
 
     int num_threads = 1, sflag = 0, tflag = 0, opt;
     long seed;
-    while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+    const char* input_path = NULL;
+    char* parameter_values = NULL;
+    char* stream_path = NULL;
+    char* restart_path = NULL;
+    while ((opt = getopt(argc, argv, "s:t:i:p:N:S:c:r:")) != -1) {
         switch (opt) {
         case 's':
             seed = atol(optarg);
@@ -127,30 +169,78 @@ int main(int argc, char**argv){
             num_threads = atoi(optarg);
             tflag = 1;
             break;
+        case 'i':
+            input_path = optarg;
+            break;
+        case 'p':
+            parameter_values = optarg;
+            break;
+        case 'N':
+            system->nt = atoi(optarg);
+            break;
+        case 'S':
+            stream_path = optarg;
+            break;
+        case 'c':
+            system->checkpoint_freq = atoi(optarg);
+            break;
+        case 'r':
+            restart_path = optarg;
+            break;
         case '?':
             printf("Usage: %s [OPTION]...\n", argv[0]);
             printf("Example: %s -t 8 -s 1059\n", argv[0]);
             printf("\nOptional arguments:\n");
             printf("  -s Seed value for random number generation.\n");
             printf("  -t Number of threads to use.\n");
-            printf("\nIf no arguments are present, seed will be based on the time plus clock and the threads will be set up to 8.\n");
+            printf("  -i Read the particles and initial condition from this file (default: particles.bin next to the executable).\n");
+            printf("  -p Comma separated values of all parameters, overriding the values in the input file.\n");
+            printf("  -N Number of time steps to simulate, overriding the value of the model.\n");
+            printf("  -S Stream binary snapshots to this file or pipe (e.g. /dev/stdout) instead of writing VTK files.\n");
+            printf("  -c Write a checkpoint every this many steps (a checkpoint is always written on SIGINT/SIGTERM).\n");
+            printf("  -r Restart from this checkpoint file.\n");
+            printf("\nIf no arguments are present, seed will be based on the time plus clock and the number of threads\n");
+            printf("will be chosen from the usable CPUs, the number of particles and a short timed probe.\n");
             break;
         }
     }
 
+    char default_input_path[4096];
+    if(input_path == NULL){
+        // by default the input file is next to the executable
+        const char* slash = strrchr(argv[0], '/');
+        snprintf(default_input_path, sizeof(default_input_path), "%.*sparticles.bin",
+                 slash == NULL ? 0 : (int)(slash - argv[0] + 1), argv[0]);
+        input_path = default_input_path;
+    }
+    // create all particles in system
+    unsigned int* input_u0 = read_particle_input_file(input_path, system, input_parameters, NUM_PARAMETERS);
+    if(parameter_values != NULL){
+        read_parameter_values(parameter_values, input_parameters, NUM_PARAMETERS);
+    }
+    // Setup chemical reaction system
+    spatialpy_initialize_rdme(system, input_u0);
+
     if(sflag){
-        dsfmt_init_gen_rand(&dsfmt, seed);
+        spatialpy_seed(seed);
     }else{
-        dsfmt_init_gen_rand(&dsfmt, (int)time(NULL)+(int)(1e9*clock()));
+        // runs started within the same second must still get different seeds
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        unsigned long mix = (unsigned long)now.tv_sec ^ (unsigned long)now.tv_nsec ^ ((unsigned long)getpid() << 16);
+        spatialpy_seed((long)(mix & 0xffffffffUL));  // the generator takes 32 bits
     }
 
-    if(!tflag){
-        num_threads = get_num_processors();
-        if(num_threads>8){ num_threads=8; }
+    if(restart_path != NULL){
+        checkpoint__restore(system, restart_path);
     }
 
-    run_simulation(num_threads, system);
-    exit(0);
+    checkpoint__install_signal_handlers();
+    // without -t the number of threads is chosen, see the run report
+    int status = spatialpy_run_simulation(system, tflag ? num_threads : 0, stream_path);
+    printf("Threads: %u (%s)\n", system->run_report->num_threads, system->run_report->threads_reason);
+    spatialpy_write_run_report(system, RUN_REPORT_FILENAME);
+    exit(status < 0 ? 1 : 0);
 
 }
 
@@ -0,0 +1,282 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#include "checkpoint.h"
+#include "linked_list.h"
+#include "particle.h"
+#include "simulate_rdme.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Binary checkpoint of the full engine state at the start of a step, written
+// in native byte order.  Restarting from it continues the run bit for bit.
+//   header:  char magic[8] = "SPDCKPT2", uint32 step, double time, double dt_next,
+//            uint32 num_particles, num_chem_species, num_stoch_species, num_stoch_rxns,
+//            uint32 has_rdme, uint32 sizeof(dsfmt_t)
+//   dsfmt_t  random number generator state
+//   if has_rdme: int initialized, long total_reactions, long total_diffusion
+//   per particle (in particle_list order):
+//       uint32 id, int type, int solidTag, double x[3], v[3], vt[3], mass, rho,
+//       nu, bvf_phi, normal[3], F[3], Frho, Fbp[3], C[nc], Q[nc]
+//       if has_rdme: uint32 xx[ns], double srrate, rrate[nr], sdrate, Ddiag[ns]
+//   uint32 id[num_particles]   order of system->x_index
+//   if has_rdme: uint32 id[num_particles], double tt[num_particles]
+//                order and event times of rdme->heap
+
+#define CHECKPOINT_MAGIC "SPDCKPT2"
+
+volatile sig_atomic_t checkpoint_requested = 0;
+
+char*checkpoint_buffer = NULL;
+size_t checkpoint_buffer_len = 0;
+size_t checkpoint_buffer_size = 0;
+
+static void checkpoint__signal_handler(int signum){
+    checkpoint_requested = signum;
+}
+
+void checkpoint__install_signal_handlers(){
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = checkpoint__signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+static void checkpoint__put(const void*data, size_t size){
+    if(checkpoint_buffer_len + size > checkpoint_buffer_size){
+        checkpoint_buffer_size = 2*(checkpoint_buffer_len + size);
+        checkpoint_buffer = realloc(checkpoint_buffer, checkpoint_buffer_size);
+    }
+    memcpy(&checkpoint_buffer[checkpoint_buffer_len], data, size);
+    checkpoint_buffer_len += size;
+}
+
+static void checkpoint__put_uint(unsigned int v){
+    checkpoint__put(&v, sizeof(v));
+}
+
+void checkpoint__sync_step(system_t*system, unsigned int step){
+    node_t*n;
+    ordered_node_t*on;
+    particle_t*p;
+    rdme_t*rdme = system->rdme;
+    checkpoint_buffer_len = 0;
+    checkpoint__put(CHECKPOINT_MAGIC, 8);
+    checkpoint__put_uint(step);
+    checkpoint__put(&system->time, sizeof(double));
+    checkpoint__put(&system->dt_next, sizeof(double));
+    checkpoint__put_uint(system->particle_list->count);
+    checkpoint__put_uint(system->num_chem_species);
+    checkpoint__put_uint(system->num_stoch_species);
+    checkpoint__put_uint(system->num_stoch_rxns);
+    checkpoint__put_uint(rdme != NULL);
+    checkpoint__put_uint(sizeof(dsfmt_t));
+    checkpoint__put(&dsfmt, sizeof(dsfmt_t));
+    if(rdme != NULL){
+        checkpoint__put(&rdme->initialized, sizeof(int));
+        checkpoint__put(&rdme->total_reactions, sizeof(long int));
+        checkpoint__put(&rdme->total_diffusion, sizeof(long int));
+    }
+    for(n=system->particle_list->head; n!=NULL; n=n->next){
+        p = n->data;
+        checkpoint__put(&p->id, sizeof(unsigned int));
+        checkpoint__put(&p->type, sizeof(int));
+        checkpoint__put(&p->solidTag, sizeof(int));
+        checkpoint__put(p->x, sizeof(double)*3);
+        checkpoint__put(p->v, sizeof(double)*3);
+        checkpoint__put(p->vt, sizeof(double)*3);
+        checkpoint__put(&p->mass, sizeof(double));
+        checkpoint__put(&p->rho, sizeof(double));
+        checkpoint__put(&p->nu, sizeof(double));
+        checkpoint__put(&p->bvf_phi, sizeof(double));
+        checkpoint__put(p->normal, sizeof(double)*3);
+        checkpoint__put(p->F, sizeof(double)*3);
+        checkpoint__put(&p->Frho, sizeof(double));
+        checkpoint__put(p->Fbp, sizeof(double)*3);
+        checkpoint__put(p->C, sizeof(double)*system->num_chem_species);
+        checkpoint__put(p->Q, sizeof(double)*system->num_chem_species);
+        if(rdme != NULL){
+            checkpoint__put(p->xx, sizeof(unsigned int)*system->num_stoch_species);
+            checkpoint__put(&p->rdme->srrate, sizeof(double));
+            checkpoint__put(p->rdme->rrate, sizeof(double)*system->num_stoch_rxns);
+            checkpoint__put(&p->rdme->sdrate, sizeof(double));
+            checkpoint__put(p->rdme->Ddiag, sizeof(double)*system->num_stoch_species);
+        }
+    }
+    for(n=system->x_index->head; n!=NULL; n=n->next){
+        checkpoint__put_uint(n->data->id);
+    }
+    if(rdme != NULL){
+        for(on=rdme->heap->head; on!=NULL; on=on->next){
+            checkpoint__put_uint(on->data->id);
+        }
+        for(on=rdme->heap->head; on!=NULL; on=on->next){
+            checkpoint__put(&on->tt, sizeof(double));
+        }
+    }
+}
+
+void checkpoint__async_step(system_t*system){
+    FILE*fp;
+    const char*tmp_filename = CHECKPOINT_FILENAME ".tmp";
+    if(debug_flag){printf("Writing file '%s'\n", CHECKPOINT_FILENAME);}
+    // Write to a temporary file first so an interruption can not leave a
+    // partial checkpoint behind
+    if((fp = fopen(tmp_filename, "wb")) == NULL){
+        perror("Can't write checkpoint file");exit(1);
+    }
+    if(fwrite(checkpoint_buffer, 1, checkpoint_buffer_len, fp) != checkpoint_buffer_len){
+        perror("Can't write checkpoint file");exit(1);
+    }
+    fclose(fp);
+    if(rename(tmp_filename, CHECKPOINT_FILENAME) != 0){
+        perror("Can't write checkpoint file");exit(1);
+    }
+}
+
+
+/**************************************************************************/
+static void checkpoint__get(FILE*fp, void*data, size_t size, const char*filename){
+    if(size > 0 && fread(data, 1, size, fp) != size){
+        fprintf(stderr, "Checkpoint file '%s' is truncated\n", filename);
+        exit(1);
+    }
+}
+
+static unsigned int checkpoint__get_uint(FILE*fp, const char*filename){
+    unsigned int v;
+    checkpoint__get(fp, &v, sizeof(v), filename);
+    return v;
+}
+
+static particle_t* checkpoint__get_particle(FILE*fp, particle_t**by_id, unsigned int max_id, const char*filename){
+    unsigned int id = checkpoint__get_uint(fp, filename);
+    if(id > max_id || by_id[id] == NULL){
+        fprintf(stderr, "Checkpoint file '%s' does not match the model (particle id %u)\n", filename, id);
+        exit(1);
+    }
+    return by_id[id];
+}
+
+void checkpoint__restore(system_t*system, const char*filename){
+    FILE*fp;
+    char magic[8];
+    unsigned int i, step, max_id = 0;
+    node_t*n;
+    particle_t*p;
+    particle_t**by_id;
+    rdme_t*rdme = system->rdme;
+    size_t np = system->particle_list->count;
+    if((fp = fopen(filename, "rb")) == NULL){
+        perror("Can't read checkpoint file");exit(1);
+    }
+    checkpoint__get(fp, magic, 8, filename);
+    if(memcmp(magic, CHECKPOINT_MAGIC, 8) != 0){
+        fprintf(stderr, "'%s' is not a checkpoint file\n", filename);
+        exit(1);
+    }
+    step = checkpoint__get_uint(fp, filename);
+    checkpoint__get(fp, &system->time, sizeof(double), filename);
+    checkpoint__get(fp, &system->dt_next, sizeof(double), filename);
+    if(checkpoint__get_uint(fp, filename) != np ||
+       checkpoint__get_uint(fp, filename) != system->num_chem_species ||
+       checkpoint__get_uint(fp, filename) != system->num_stoch_species ||
+       checkpoint__get_uint(fp, filename) != system->num_stoch_rxns ||
+       checkpoint__get_uint(fp, filename) != (rdme != NULL) ||
+       checkpoint__get_uint(fp, filename) != sizeof(dsfmt_t)){
+        fprintf(stderr, "Checkpoint file '%s' does not match the model\n", filename);
+        exit(1);
+    }
+    checkpoint__get(fp, &dsfmt, sizeof(dsfmt_t), filename);
+    if(rdme != NULL){
+        checkpoint__get(fp, &rdme->initialized, sizeof(int), filename);
+        checkpoint__get(fp, &rdme->total_reactions, sizeof(long int), filename);
+        checkpoint__get(fp, &rdme->total_diffusion, sizeof(long int), filename);
+    }
+
+    for(n=system->particle_list->head; n!=NULL; n=n->next){
+        if(n->data->id > max_id){ max_id = n->data->id; }
+    }
+    by_id = (particle_t**) calloc(max_id+1, sizeof(particle_t*));
+    for(n=system->particle_list->head; n!=NULL; n=n->next){
+        by_id[n->data->id] = n->data;
+    }
+
+    for(i=0; i<np; i++){
+        p = checkpoint__get_particle(fp, by_id, max_id, filename);
+        checkpoint__get(fp, &p->type, sizeof(int), filename);
+        checkpoint__get(fp, &p->solidTag, sizeof(int), filename);
+        checkpoint__get(fp, p->x, sizeof(double)*3, filename);
+        checkpoint__get(fp, p->v, sizeof(double)*3, filename);
+        checkpoint__get(fp, p->vt, sizeof(double)*3, filename);
+        checkpoint__get(fp, &p->mass, sizeof(double), filename);
+        checkpoint__get(fp, &p->rho, sizeof(double), filename);
+        checkpoint__get(fp, &p->nu, sizeof(double), filename);
+        checkpoint__get(fp, &p->bvf_phi, sizeof(double), filename);
+        checkpoint__get(fp, p->normal, sizeof(double)*3, filename);
+        checkpoint__get(fp, p->F, sizeof(double)*3, filename);
+        checkpoint__get(fp, &p->Frho, sizeof(double), filename);
+        checkpoint__get(fp, p->Fbp, sizeof(double)*3, filename);
+        checkpoint__get(fp, p->C, sizeof(double)*system->num_chem_species, filename);
+        checkpoint__get(fp, p->Q, sizeof(double)*system->num_chem_species, filename);
+        particle__publish(p, system);
+        if(rdme != NULL){
+            checkpoint__get(fp, p->xx, sizeof(unsigned int)*system->num_stoch_species, filename);
+            checkpoint__get(fp, &p->rdme->srrate, sizeof(double), filename);
+            checkpoint__get(fp, p->rdme->rrate, sizeof(double)*system->num_stoch_rxns, filename);
+            checkpoint__get(fp, &p->rdme->sdrate, sizeof(double), filename);
+            checkpoint__get(fp, p->rdme->Ddiag, sizeof(double)*system->num_stoch_species, filename);
+        }
+    }
+
+    // Relink the position index in the saved order, the order of particles
+    // with equal keys decides the order of the neighbor lists
+    node_t*prev = NULL;
+    for(i=0; i<np; i++){
+        p = checkpoint__get_particle(fp, by_id, max_id, filename);
+        n = p->x_index;
+        n->prev = prev;
+        if(prev == NULL){
+            system->x_index->head = n;
+        }else{
+            prev->next = n;
+        }
+        prev = n;
+    }
+    prev->next = NULL;
+    system->x_index->tail = prev;
+
+    // Relink the RDME event heap and restore the event times
+    if(rdme != NULL){
+        ordered_node_t*on, *oprev = NULL;
+        for(i=0; i<np; i++){
+            p = checkpoint__get_particle(fp, by_id, max_id, filename);
+            on = p->rdme->heap_index;
+            on->prev = oprev;
+            if(oprev == NULL){
+                rdme->heap->head = on;
+            }else{
+                oprev->next = on;
+            }
+            oprev = on;
+        }
+        oprev->next = NULL;
+        rdme->heap->tail = oprev;
+        for(on=rdme->heap->head; on!=NULL; on=on->next){
+            checkpoint__get(fp, &on->tt, sizeof(double), filename);
+        }
+    }
+    fclose(fp);
+    free(by_id);
+    system->start_step = step;
+    if(debug_flag){printf("Restarting from '%s' at step %u\n", filename, step);}
+}
@@ -0,0 +1,212 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#include "chem_diffusion.h"
+#include "diffusion_masks.h"
+#include "linked_list.h"
+#include "particle.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+chem_diffusion_t* chem_diffusion__create(system_t* system){
+    size_t N = system->particle_list->count;
+    double h = system->h;
+    double eps = 0.001 * h;
+    double hh = 0.01 * h * h;
+    node_t* n;
+    neighbor_node_t* nn;
+    chem_diffusion_t* d = malloc(sizeof(chem_diffusion_t));
+    d->num_rows = N;
+    d->row_ptr = calloc(N + 1, sizeof(size_t));
+    d->particles = malloc(sizeof(particle_t*) * N);
+    d->work = malloc(sizeof(double) * 7 * N);
+    if(d->row_ptr == NULL || d->particles == NULL || d->work == NULL){
+        perror("chem_diffusion__create");
+        exit(1);
+    }
+    // pairs outside of the kernel support and singular pairs add nothing, as in pairwiseForce()
+    for(n = system->particle_list->head; n != NULL; n = n->next){
+        particle_t* p = n->data;
+        d->particles[p->id] = p;
+        for(nn = p->neighbors->head; nn != NULL; nn = nn->next){
+            if(!(nn->dist / h > 1.0 || nn->dist == 0.0)){
+                d->row_ptr[p->id + 1]++;
+            }
+        }
+    }
+    size_t i;
+    for(i = 0; i < N; i++){
+        d->row_ptr[i + 1] += d->row_ptr[i];
+    }
+    d->col = malloc(sizeof(unsigned int) * (d->row_ptr[N] > 0 ? d->row_ptr[N] : 1));
+    d->w = malloc(sizeof(double) * (d->row_ptr[N] > 0 ? d->row_ptr[N] : 1));
+    if(d->col == NULL || d->w == NULL){
+        perror("chem_diffusion__create");
+        exit(1);
+    }
+    for(i = 0; i < N; i++){
+        particle_t* p = d->particles[i];
+        size_t k = d->row_ptr[i];
+        for(nn = p->neighbors->head; nn != NULL; nn = nn->next){
+            double r = nn->dist;
+            if(r / h > 1.0 || r == 0.0){
+                continue;
+            }
+            particle_t* q = nn->data;
+            double wfd = nn->dWdr / (r + eps);
+            d->col[k] = q->id;
+            d->w[k] = 2.0 * ((p->mass * q->mass) / (p->mass + q->mass)) * ((p->rho + q->rho) / (p->rho * q->rho))
+                      * (r * r) * wfd / ((r * r) + hh);
+            k++;
+        }
+    }
+    return d;
+}
+
+void chem_diffusion__destroy(chem_diffusion_t* d){
+    if(d == NULL){
+        return;
+    }
+    free(d->row_ptr);
+    free(d->col);
+    free(d->w);
+    free(d->particles);
+    free(d->work);
+    free(d);
+}
+
+void chem_diffusion__add_flux(const chem_diffusion_t* d, particle_t* me, system_t* system){
+    const diffusion_masks_t* masks = system->diffusion_masks;
+    size_t a, k;
+    size_t begin = d->row_ptr[me->id], end = d->row_ptr[me->id + 1];
+    // Note about below:  types start at  1
+    for(a = masks->type_ptr[me->type - 1]; a < masks->type_ptr[me->type]; a++){
+        unsigned int s = masks->species[a];
+        double D = masks->D[a];
+        if(masks->everywhere[s]){
+            for(k = begin; k < end; k++){
+                me->Q[s] += D * (me->C[s] - d->particles[d->col[k]]->published.C[s]) * d->w[k];
+            }
+        }else{
+            for(k = begin; k < end; k++){
+                particle_t* q = d->particles[d->col[k]];
+                if(diffusion_masks__allowed(masks, system, s, q->type)){
+                    me->Q[s] += D * (me->C[s] - q->published.C[s]) * d->w[k];
+                }
+            }
+        }
+    }
+}
+
+// q = A p on the rows that are solved for (diag > 0), with
+// A = diag(1/D) + dt*L and L the graph Laplacian of the weights -w_ij
+static void chem_diffusion__product(const chem_diffusion_t* d, double dt, const double* diag,
+                                    const double* p, double* q){
+    size_t i, k;
+    for(i = 0; i < d->num_rows; i++){
+        if(diag[i] == 0.0){
+            q[i] = 0.0;
+            continue;
+        }
+        double sum = diag[i] * p[i];
+        for(k = d->row_ptr[i]; k < d->row_ptr[i + 1]; k++){
+            unsigned int j = d->col[k];
+            if(diag[j] != 0.0){
+                sum += dt * d->w[k] * p[j];
+            }
+        }
+        q[i] = sum;
+    }
+}
+
+static double chem_diffusion__dot(size_t n, const double* a, const double* b){
+    double sum = 0.0;
+    size_t i;
+    for(i = 0; i < n; i++){
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+void chem_diffusion__solve_implicit(chem_diffusion_t* d, system_t* system, double dt){
+    size_t N = d->num_rows;
+    double* x = d->work;
+    double* rhs = x + N;
+    double* r = rhs + N;
+    double* z = r + N;
+    double* p = z + N;
+    double* q = p + N;
+    double* diag = q + N;  // 0 on the rows of particles that do not diffuse
+    const double* matrix = system->subdomain_diffusion_matrix;
+    size_t i, k, s, num_rows;
+    int iteration;
+    for(s = 0; s < system->num_chem_species; s++){
+        num_rows = 0;
+        for(i = 0; i < N; i++){
+            particle_t* me = d->particles[i];
+            // Note about below:  types start at  1
+            double D = matrix[s * system->num_types + (me->type - 1)];
+            x[i] = me->C[s];
+            diag[i] = 0.0;
+            rhs[i] = 0.0;
+            if(D > 0.0){
+                diag[i] = 1.0 / D;
+                rhs[i] = x[i] / D;
+                num_rows++;
+            }
+        }
+        // an immobile species keeps its concentrations
+        if(num_rows == 0){
+            continue;
+        }
+        // pairs with a particle that the species does not diffuse into are not coupled
+        for(i = 0; i < N; i++){
+            if(diag[i] == 0.0){
+                continue;
+            }
+            for(k = d->row_ptr[i]; k < d->row_ptr[i + 1]; k++){
+                if(diag[d->col[k]] != 0.0){
+                    diag[i] -= dt * d->w[k];
+                }
+            }
+        }
+        // preconditioned conjugate gradients, from the current concentrations
+        chem_diffusion__product(d, dt, diag, x, q);
+        for(i = 0; i < N; i++){
+            r[i] = rhs[i] - q[i];
+            z[i] = diag[i] == 0.0 ? 0.0 : r[i] / diag[i];
+            p[i] = z[i];
+        }
+        double limit = CHEM_DIFFUSION_CG_TOLERANCE * sqrt(chem_diffusion__dot(N, rhs, rhs));
+        double rz = chem_diffusion__dot(N, r, z);
+        for(iteration = 0; sqrt(chem_diffusion__dot(N, r, r)) > limit; iteration++){
+            if(iteration == CHEM_DIFFUSION_CG_MAX_ITERATIONS){
+                printf("Error: the implicit diffusion of species %zu did not converge at time %e\n", s, system->time);
+                exit(1);
+            }
+            chem_diffusion__product(d, dt, diag, p, q);
+            double alpha = rz / chem_diffusion__dot(N, p, q);
+            for(i = 0; i < N; i++){
+                x[i] += alpha * p[i];
+                r[i] -= alpha * q[i];
+                z[i] = diag[i] == 0.0 ? 0.0 : r[i] / diag[i];
+            }
+            double rz_next = chem_diffusion__dot(N, r, z);
+            double beta = rz_next / rz;
+            rz = rz_next;
+            for(i = 0; i < N; i++){
+                p[i] = z[i] + beta * p[i];
+            }
+        }
+        for(i = 0; i < N; i++){
+            if(diag[i] != 0.0){
+                d->particles[i]->C[s] = x[i];
+            }
+        }
+    }
+}
@@ -5,6 +5,9 @@ Copyright 2018 Brian Drawert (UNCA)
 This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
 See the file LICENSE.txt for details.
 ***************************************************************************************** */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // sched_getaffinity(), CPU_COUNT()
+#endif
 
 
 #ifdef _WIN32
@@ -13,6 +16,10 @@ See the file LICENSE.txt for details.
 #include <sys/param.h>
 #include <sys/sysctl.h>
 #else
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #endif
 
@@ -42,3 +49,57 @@ int get_num_processors() {
     return sysconf(_SC_NPROCESSORS_ONLN);
 #endif
 }
+
+// Number of CPUs this process may run on (sched_getaffinity), which is less
+// than the number of online CPUs when started with taskset or in a container
+int get_num_affinity_processors() {
+#if defined(__linux__) && defined(CPU_COUNT)
+    cpu_set_t set;
+    if(sched_getaffinity(0, sizeof(set), &set) == 0){
+        return CPU_COUNT(&set);
+    }
+#endif
+    return get_num_processors();
+}
+
+// CPU quota of the cgroup of this process in CPUs (cgroup v2 cpu.max or v1
+// cpu.cfs_quota_us/cpu.cfs_period_us), 0 if there is no quota
+double get_cgroup_cpu_quota() {
+#if defined(__linux__)
+    FILE* fp;
+    char quota[64];
+    long period;
+    double cpus = 0.0;
+    if((fp = fopen("/sys/fs/cgroup/cpu.max", "r")) != NULL){
+        if(fscanf(fp, "%63s %ld", quota, &period) == 2 && period > 0 && quota[0] != 'm'){
+            cpus = atof(quota) / period;
+        }
+        fclose(fp);
+    }else if((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL){
+        long quota_us;
+        int r = fscanf(fp, "%ld", &quota_us);
+        fclose(fp);
+        if(r == 1 && quota_us > 0 && (fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL){
+            if(fscanf(fp, "%ld", &period) == 1 && period > 0){
+                cpus = (double) quota_us / period;
+            }
+            fclose(fp);
+        }
+    }
+    return cpus;
+#else
+    return 0.0;
+#endif
+}
+
+// Number of CPUs this process can keep busy: the affinity mask, limited by
+// the cgroup quota (rounded up)
+int get_num_usable_processors() {
+    int num_cpus = get_num_affinity_processors();
+    double quota = get_cgroup_cpu_quota();
+    if(quota > 0.0 && ceil(quota) < num_cpus){
+        num_cpus = (int) ceil(quota);
+    }
+    if(num_cpus < 1){ num_cpus = 1; }
+    return num_cpus;
+}
@@ -0,0 +1,66 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#include "diffusion_masks.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+void diffusion_masks__build(system_t* system){
+    if(system->diffusion_masks != NULL || system->subdomain_diffusion_matrix == NULL){
+        return;
+    }
+    size_t num_types = system->num_types;
+    size_t num_species = system->num_chem_species > system->num_stoch_species ?
+                         system->num_chem_species : system->num_stoch_species;
+    const double* matrix = system->subdomain_diffusion_matrix;
+    size_t s, t, k;
+    diffusion_masks_t* m = malloc(sizeof(diffusion_masks_t));
+    if(m == NULL){
+        perror("diffusion_masks__build");
+        exit(1);
+    }
+    m->num_types = num_types;
+    m->num_species = num_species;
+    m->type_ptr = malloc(sizeof(size_t) * (num_types + 1));
+    m->species = malloc(sizeof(unsigned int) * (num_types * num_species > 0 ? num_types * num_species : 1));
+    m->D = malloc(sizeof(double) * (num_types * num_species > 0 ? num_types * num_species : 1));
+    m->everywhere = malloc(num_species > 0 ? num_species : 1);
+    if(m->type_ptr == NULL || m->species == NULL || m->D == NULL || m->everywhere == NULL){
+        perror("diffusion_masks__build");
+        exit(1);
+    }
+    for(s = 0; s < num_species; s++){
+        m->everywhere[s] = 1;
+    }
+    k = 0;
+    for(t = 0; t < num_types; t++){
+        m->type_ptr[t] = k;
+        for(s = 0; s < num_species; s++){
+            double D = matrix[s * num_types + t];
+            if(D > 0.0){
+                m->species[k] = s;
+                m->D[k] = D;
+                k++;
+            }else{
+                m->everywhere[s] = 0;
+            }
+        }
+    }
+    m->type_ptr[num_types] = k;
+    system->diffusion_masks = m;
+}
+
+void diffusion_masks__destroy(diffusion_masks_t* m){
+    if(m == NULL){
+        return;
+    }
+    free(m->type_ptr);
+    free(m->species);
+    free(m->D);
+    free(m->everywhere);
+    free(m);
+}
@@ -0,0 +1,77 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#include "dt_control.h"
+#include "linked_list.h"
+#include "particle.h"
+#include <math.h>
+#include <stdio.h>
+
+// Largest diffusion constant of the deterministic species over all types
+static double dt_control__max_chem_diffusion(system_t* system){
+    double max_D = 0.0;
+    size_t i;
+    if(system->subdomain_diffusion_matrix == NULL){
+        return max_D;
+    }
+    for(i=0; i < system->num_chem_species * system->num_types; i++){
+        if(system->subdomain_diffusion_matrix[i] > max_D){ max_D = system->subdomain_diffusion_matrix[i]; }
+    }
+    return max_D;
+}
+
+double dt_control__stable_dt(system_t* system, const dt_limits_t* limits){
+    // nothing moves in a static domain or without fluid particles
+    int moving = !system->static_domain && limits->num_fluid > 0;
+    double dt = moving ? INFINITY : system->dt_nominal;
+    if(system->dt_max > 0.0 && system->dt_max < dt){ dt = system->dt_max; }
+    if(!moving){
+        return dt;
+    }
+    double h = system->h;
+    double c = sqrt(DT_PRESSURE_FACTOR * system->P0 / system->rho0);
+    double dt_cfl = DT_CFL_FACTOR * h / (c + sqrt(limits->max_v2));
+    if(dt_cfl < dt){ dt = dt_cfl; }
+    if(limits->max_nu > 0.0){
+        double dt_viscous = DT_VISCOUS_FACTOR * h * h / limits->max_nu;
+        if(dt_viscous < dt){ dt = dt_viscous; }
+    }
+    if(limits->max_F2 > 0.0){
+        double dt_force = DT_FORCE_FACTOR * sqrt(h / sqrt(limits->max_F2));
+        if(dt_force < dt){ dt = dt_force; }
+    }
+    // backward Euler diffusion (system->implicit_diffusion) is stable at any step size
+    double max_D = system->implicit_diffusion ? 0.0 : dt_control__max_chem_diffusion(system);
+    if(max_D > 0.0){
+        double dt_diffusion = DT_VISCOUS_FACTOR * h * h / max_D;
+        if(dt_diffusion < dt){ dt = dt_diffusion; }
+    }
+    // the previous stable step size, not the step shortened to an output time
+    if(system->dt_next > 0.0 && dt > DT_GROWTH_FACTOR * system->dt_next){
+        dt = DT_GROWTH_FACTOR * system->dt_next;
+    }
+    if(dt < DT_MIN_FACTOR * system->dt_nominal){
+        fprintf(stderr, "Error: the adaptive time step fell to %e at time %e, the simulation is unstable\n", dt, system->time);
+        return 0.0;
+    }
+    return dt;
+}
+
+double dt_control__initial_dt(system_t* system){
+    dt_limits_t limits;
+    node_t* n;
+    dt_limits__clear(&limits);
+    for(n=system->particle_list->head; n!=NULL; n=n->next){
+        dt_limits__accumulate(&limits, n->data);
+    }
+    // the forces of the first step are not known yet
+    double dt = dt_control__stable_dt(system, &limits);
+    if(dt > system->dt_nominal){
+        dt = system->dt_nominal;
+    }
+    return dt;
+}
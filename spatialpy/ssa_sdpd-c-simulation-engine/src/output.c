@@ -7,6 +7,8 @@ See the file LICENSE.txt for details.
 ***************************************************************************************** */
 #include "output.h"
 #include "particle.h"
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,6 +47,7 @@ void output_vtk__sync_step(system_t*system, int current_step){
         output_buffer_size = system->particle_list->count;
         output_buffer = (particle_t*) malloc(sizeof(particle_t)*output_buffer_size);
     }else if(output_buffer_size < system->particle_list->count){
+        output_buffer_size = system->particle_list->count;
         output_buffer = realloc(output_buffer, sizeof(particle_t)*output_buffer_size);
     }
     if(system->num_chem_species > 0){
@@ -100,9 +103,184 @@ void output_vtk__sync_step(system_t*system, int current_step){
         }
     }
 }
+
+
+/**************************************************************************/
+// Parallel formatting of the VTK output.  The particles are split into
+// contiguous ranges, one per output thread, and each thread formats every
+// field of its range into its own buffer.  The buffers are then written to
+// the file in order, one fwrite() per chunk.
+
+#define OUTPUT_VALUE_MAX_LEN 400  // longest string a single value can produce
+
+typedef struct __output_chunk_t output_chunk_t;
+struct __output_chunk_t {
+    system_t*system;
+    int start;
+    int end;
+    int num_fields;
+    char**buf;
+    size_t*len;
+    size_t*cap;
+    pthread_t handle;
+};
+
+output_chunk_t*output_chunks = NULL;
+int output_num_chunks = 0;
+
+static inline char* output_chunk__reserve(output_chunk_t*c, int field){
+    if(c->len[field] + OUTPUT_VALUE_MAX_LEN > c->cap[field]){
+        c->cap[field] = 2*c->cap[field] + OUTPUT_VALUE_MAX_LEN;
+        c->buf[field] = realloc(c->buf[field], c->cap[field]);
+    }
+    return c->buf[field] + c->len[field];
+}
+
+static inline int format_uint(char*s, unsigned long long v){
+    char tmp[24];
+    int n = 0, i;
+    do{
+        tmp[n++] = '0' + (v % 10);
+        v /= 10;
+    }while(v > 0);
+    for(i=0; i<n; i++){
+        s[i] = tmp[n-1-i];
+    }
+    return n;
+}
+
+static inline int format_int(char*s, long long v){
+    if(v < 0){
+        s[0] = '-';
+        return 1 + format_uint(s+1, (unsigned long long)(-v));
+    }
+    return format_uint(s, (unsigned long long)v);
+}
+
+// Equivalent of printf("%lf"), i.e. six digits after the decimal point.
+// Values outside of +/-1e9 (and NaN/Inf) fall back to snprintf().
+static inline int format_fixed6(char*s, double v){
+    char*p = s;
+    double ip, frac, scaled, err, fl;
+    unsigned long long ipart, fpart;
+    int i;
+    if(!(v > -1e9 && v < 1e9)){
+        return snprintf(s, OUTPUT_VALUE_MAX_LEN, "%lf", v);
+    }
+    if(signbit(v)){
+        *p++ = '-';
+        v = -v;
+    }
+    ip = floor(v);
+    frac = v - ip;  // exact
+    scaled = frac * 1e6;
+    fl = floor(scaled);
+    // round to nearest on the exact value, ties to even (as printf does)
+    if(scaled - fl > 0.5){
+        fl += 1.0;
+    }else if(scaled - fl == 0.5){
+        err = fma(frac, 1e6, -scaled);  // exact rounding error of the product
+        if(err > 0.0 || (err == 0.0 && fmod(fl, 2.0) != 0.0)){
+            fl += 1.0;
+        }
+    }
+    fpart = (unsigned long long) fl;
+    ipart = (unsigned long long) ip;
+    if(fpart >= 1000000ULL){
+        fpart -= 1000000ULL;
+        ipart++;
+    }
+    p += format_uint(p, ipart);
+    *p++ = '.';
+    for(i=5; i>=0; i--){
+        p[i] = '0' + (fpart % 10);
+        fpart /= 10;
+    }
+    return (p + 6) - s;
+}
+
+static inline void output_chunk__add_uint(output_chunk_t*c, int field, unsigned int v, int i, int per_line){
+    char*p = output_chunk__reserve(c, field);
+    int n = format_uint(p, v);
+    p[n++] = ' ';
+    if((i+1)%per_line==0){ p[n++] = '\n'; }
+    c->len[field] += n;
+}
+
+static inline void output_chunk__add_double(output_chunk_t*c, int field, double v, int i, int per_line){
+    char*p = output_chunk__reserve(c, field);
+    int n = format_fixed6(p, v);
+    p[n++] = ' ';
+    if((i+1)%per_line==0){ p[n++] = '\n'; }
+    c->len[field] += n;
+}
+
+static inline void output_chunk__add_vec3(output_chunk_t*c, int field, const double*v, int i){
+    char*p = output_chunk__reserve(c, field);
+    int n = format_fixed6(p, v[0]);
+    p[n++] = ' ';
+    n += format_fixed6(p+n, v[1]);
+    p[n++] = ' ';
+    n += format_fixed6(p+n, v[2]);
+    p[n++] = ' ';
+    if((i+1)%3==0){ p[n++] = '\n'; }
+    c->len[field] += n;
+}
+
+void* output_vtk__format_chunk(void*arg){
+    output_chunk_t*c = (output_chunk_t*) arg;
+    system_t*system = c->system;
+    int i, s, f, n;
+    char*p;
+    for(f=0; f<c->num_fields; f++){
+        c->len[f] = 0;
+    }
+    for(i=c->start; i<c->end; i++){
+        particle_t*b = &output_buffer[i];
+        // 0: POINTS
+        p = output_chunk__reserve(c, 0);
+        n = snprintf(p, OUTPUT_VALUE_MAX_LEN, "%.10e %.10e %.10e ", b->x[0], b->x[1], b->x[2]);
+        if((i+1)%3==0){ p[n++] = '\n'; }
+        c->len[0] += n;
+        // 1: VERTICES
+        p = output_chunk__reserve(c, 1);
+        memcpy(p, "1 ", 2);
+        n = 2 + format_int(p+2, i);
+        p[n++] = '\n';
+        c->len[1] += n;
+        // 2-8: particle fields
+        output_chunk__add_uint(c, 2, b->id, i, 9);
+        output_chunk__add_uint(c, 3, b->type, i, 9);
+        output_chunk__add_vec3(c, 4, b->v, i);
+        output_chunk__add_double(c, 5, b->rho, i, 9);
+        output_chunk__add_double(c, 6, b->mass, i, 9);
+        output_chunk__add_double(c, 7, b->bvf_phi, i, 9);
+        output_chunk__add_double(c, 8, b->nu, i, 9);
+        f = 9;
+        for(s=0; s<system->num_chem_species; s++){
+            output_chunk__add_double(c, f++, output_buffer_chem[i*system->num_chem_species+s], i, 9);
+        }
+        if(system->rdme != NULL){
+            for(s=0; s<system->num_stoch_species; s++){
+                output_chunk__add_uint(c, f++, output_buffer_xx[i*system->num_stoch_species+s], i, 9);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void output_vtk__write_field(FILE*fp, int field){
+    int t;
+    for(t=0; t<output_num_chunks; t++){
+        if(output_chunks[t].len[field] > 0){
+            fwrite(output_chunks[t].buf[field], 1, output_chunks[t].len[field], fp);
+        }
+    }
+}
+
 void output_vtk__async_step(system_t*system){
     FILE*fp;
-    int i;
+    int i, t;
     char filename[256];
     int np = output_buffer_current_num_particles;
     if(output_buffer_current_step == 0){
@@ -124,6 +302,54 @@ void output_vtk__async_step(system_t*system){
         fprintf(fp, "%lf %lf\n", system->zlo, system->zhi);
         fclose(fp);
     }
+
+    int num_fields = 7;
+    if(system->rdme != NULL){
+        num_fields += system->num_stoch_species;
+    }
+    if(system->num_chem_species > 0){
+        num_fields += system->num_chem_species;
+    }
+
+    // Split the particles between the output threads and format in parallel
+    int num_chunks = system->num_output_threads;
+    if(num_chunks < 1){ num_chunks = 1; }
+    if(num_chunks > np){ num_chunks = (np > 0) ? np : 1; }
+    if(output_num_chunks < num_chunks){
+        output_chunks = realloc(output_chunks, sizeof(output_chunk_t)*num_chunks);
+        for(t=output_num_chunks; t<num_chunks; t++){
+            output_chunks[t].num_fields = 0;
+            output_chunks[t].buf = NULL;
+            output_chunks[t].len = NULL;
+            output_chunks[t].cap = NULL;
+        }
+    }
+    output_num_chunks = num_chunks;
+    for(t=0; t<num_chunks; t++){
+        output_chunk_t*c = &output_chunks[t];
+        c->system = system;
+        c->start = (int)(((long)np * t) / num_chunks);
+        c->end = (int)(((long)np * (t+1)) / num_chunks);
+        if(c->num_fields < num_fields + 2){
+            c->buf = realloc(c->buf, sizeof(char*)*(num_fields+2));
+            c->len = realloc(c->len, sizeof(size_t)*(num_fields+2));
+            c->cap = realloc(c->cap, sizeof(size_t)*(num_fields+2));
+            for(i=c->num_fields; i<num_fields+2; i++){
+                c->buf[i] = NULL;
+                c->len[i] = 0;
+                c->cap[i] = 0;
+            }
+        }
+        c->num_fields = num_fields + 2;  // + POINTS and VERTICES
+    }
+    for(t=1; t<num_chunks; t++){
+        pthread_create(&output_chunks[t].handle, NULL, output_vtk__format_chunk, &output_chunks[t]);
+    }
+    output_vtk__format_chunk(&output_chunks[0]);
+    for(t=1; t<num_chunks; t++){
+        pthread_join(output_chunks[t].handle, NULL);
+    }
+
     sprintf(filename,"output%u.vtk",output_buffer_current_step);
     if(debug_flag){printf("Writing file '%s'\n", filename);}
     if((fp = fopen(filename,"w+"))==NULL){ 
@@ -134,78 +360,42 @@ void output_vtk__async_step(system_t*system){
     fprintf(fp, "ASCII\n");
     fprintf(fp, "DATASET POLYDATA\n");
     fprintf(fp, "POINTS %i float\n",np);
-    for(i=0;i<np;i++){
-        //fprintf(fp, "%lf %lf %lf ",output_buffer[i].x[0],output_buffer[i].x[1],output_buffer[i].x[2]);
-        fprintf(fp, "%.10e %.10e %.10e ",output_buffer[i].x[0],output_buffer[i].x[1],output_buffer[i].x[2]);
-        if((i+1)%3==0){ fprintf(fp,"\n"); }
-    }
+    output_vtk__write_field(fp, 0);
     fprintf(fp,"\n");
     fprintf(fp, "VERTICES %i %i\n",np,2*np);
-    for(i=0;i<np;i++){
-        fprintf(fp,"1 %i\n",i);
-    }
+    output_vtk__write_field(fp, 1);
     fprintf(fp,"\n");
     fprintf(fp,"POINT_DATA %i\n", np);
-    int num_fields = 7;
-    if(system->rdme != NULL){
-        num_fields += system->num_stoch_species;
-    }
-    if(system->num_chem_species > 0){
-        num_fields += system->num_chem_species;
-    }
     fprintf(fp,"FIELD FieldData %i\n",num_fields);//
     fprintf(fp,"id 1 %i int\n", np);
-    for(i=0;i<np;i++){
-        fprintf(fp, "%u ",output_buffer[i].id);
-        if((i+1)%9==0){ fprintf(fp,"\n"); }
-    }
+    output_vtk__write_field(fp, 2);
     fprintf(fp,"\n");
     fprintf(fp,"type 1 %i int\n", np);
-    for(i=0;i<np;i++){
-        fprintf(fp, "%u ",output_buffer[i].type);
-        if((i+1)%9==0){ fprintf(fp,"\n"); }
-    }
+    output_vtk__write_field(fp, 3);
     fprintf(fp,"\n");
     fprintf(fp,"v 3 %i double\n",np);
-    for(i=0;i<np;i++){
-        fprintf(fp, "%lf %lf %lf ",output_buffer[i].v[0],output_buffer[i].v[1],output_buffer[i].v[2]);
-        if((i+1)%3==0){ fprintf(fp,"\n"); }
-    }
+    output_vtk__write_field(fp, 4);
     fprintf(fp,"\n");
     fprintf(fp,"rho 1 %i double\n", np);
-    for(i=0;i<np;i++){
-        fprintf(fp, "%lf ",output_buffer[i].rho);
-        if((i+1)%9==0){ fprintf(fp,"\n"); }
-    }
+    output_vtk__write_field(fp, 5);
     fprintf(fp,"\n");
     fprintf(fp,"mass 1 %i double\n", np);
-    for(i=0;i<np;i++){
-        fprintf(fp, "%lf ",output_buffer[i].mass);
-        if((i+1)%9==0){ fprintf(fp,"\n"); }
-    }
+    output_vtk__write_field(fp, 6);
     fprintf(fp,"\n");
     fprintf(fp,"bvf_phi 1 %i double\n", np);
-    for(i=0;i<np;i++){
-        fprintf(fp, "%lf ",output_buffer[i].bvf_phi);
-        if((i+1)%9==0){ fprintf(fp,"\n"); }
-    } 
+    output_vtk__write_field(fp, 7);
     fprintf(fp,"\n");
     fprintf(fp,"nu 1 %i double\n", np);
-    for(i=0;i<np;i++){
-        fprintf(fp, "%lf ",output_buffer[i].nu);
-        if((i+1)%9==0){ fprintf(fp,"\n"); }
-    } 
+    output_vtk__write_field(fp, 8);
     fprintf(fp,"\n");
+    int f = 9;
     // loop here to check for continous species
     // c - concentration or continous? clarify at meeting
     if(system->num_chem_species > 0){
         int s;
         for(s=0;s<system->num_chem_species;s++){
             fprintf(fp,"C[%s] 1 %i double\n", system->species_names[s], np);
-            for(i=0;i<np;i++){
-                fprintf(fp, "%lf ",output_buffer_chem[i*system->num_chem_species+s] );
-                if((i+1)%9==0){ fprintf(fp,"\n"); }
-            }
+            output_vtk__write_field(fp, f++);
             fprintf(fp,"\n");
         }
     }
@@ -214,10 +404,7 @@ void output_vtk__async_step(system_t*system){
         int s;
         for(s=0;s<system->num_stoch_species;s++){
             fprintf(fp,"D[%s] 1 %i int\n", system->species_names[s], np);
-            for(i=0;i<np;i++){
-                fprintf(fp, "%u ",output_buffer_xx[i*system->num_stoch_species+s] );
-                if((i+1)%9==0){ fprintf(fp,"\n"); }
-            }
+            output_vtk__write_field(fp, f++);
             fprintf(fp,"\n");
         }
     }
@@ -226,3 +413,89 @@ void output_vtk__async_step(system_t*system){
 
 }
 
+
+/**************************************************************************/
+// Binary snapshot stream.  Instead of one VTK file per output step, the
+// snapshots are written to a single stream (a pipe, fifo or file) that is
+// consumed incrementally by spatialpy.StreamResult.  All values are in native
+// byte order.
+//   header:  char magic[8] = "SPDSTRM1", uint32 num_chem_species,
+//            uint32 num_stoch_species (0 if the RDME is disabled)
+//   per snapshot:  uint32 step, uint32 num_particles, then the arrays
+//            int32 id[np], int32 type[np], float32 x[np][3], float64 v[np][3],
+//            float64 rho[np], mass[np], bvf_phi[np], nu[np],
+//            float64 C[np][num_chem_species], int32 D[np][num_stoch_species]
+// The arrays are in the same order as the fields of the VTK files.
+
+#define OUTPUT_STREAM_MAGIC "SPDSTRM1"
+
+char*output_stream_buffer = NULL;
+size_t output_stream_buffer_size = 0;
+
+void output_stream__open(system_t*system, const char*path){
+    unsigned int header[2];
+    if((system->output_stream = fopen(path, "wb")) == NULL){
+        perror("Can't open output stream");exit(1);
+    }
+    header[0] = system->num_chem_species;
+    header[1] = (system->rdme != NULL) ? system->num_stoch_species : 0;
+    fwrite(OUTPUT_STREAM_MAGIC, 1, 8, system->output_stream);
+    fwrite(header, sizeof(unsigned int), 2, system->output_stream);
+    fflush(system->output_stream);
+}
+
+static inline void output_stream__write(system_t*system, const void*data, size_t size){
+    if(size > 0 && fwrite(data, 1, size, system->output_stream) != size){
+        perror("Can't write to output stream");exit(1);
+    }
+}
+
+void output_stream__async_step(system_t*system){
+    int i;
+    unsigned int header[2];
+    int np = output_buffer_current_num_particles;
+    int num_stoch = (system->rdme != NULL) ? system->num_stoch_species : 0;
+    size_t size = sizeof(double)*3*np;
+    if(output_stream_buffer_size < size){
+        output_stream_buffer = realloc(output_stream_buffer, size);
+        output_stream_buffer_size = size;
+    }
+    int*ibuf = (int*) output_stream_buffer;
+    float*fbuf = (float*) output_stream_buffer;
+    double*dbuf = (double*) output_stream_buffer;
+
+    header[0] = output_buffer_current_step;
+    header[1] = np;
+    output_stream__write(system, header, sizeof(header));
+    for(i=0; i<np; i++){ ibuf[i] = output_buffer[i].id; }
+    output_stream__write(system, ibuf, sizeof(int)*np);
+    for(i=0; i<np; i++){ ibuf[i] = output_buffer[i].type; }
+    output_stream__write(system, ibuf, sizeof(int)*np);
+    for(i=0; i<np; i++){
+        fbuf[3*i] = output_buffer[i].x[0];
+        fbuf[3*i+1] = output_buffer[i].x[1];
+        fbuf[3*i+2] = output_buffer[i].x[2];
+    }
+    output_stream__write(system, fbuf, sizeof(float)*3*np);
+    for(i=0; i<np; i++){
+        dbuf[3*i] = output_buffer[i].v[0];
+        dbuf[3*i+1] = output_buffer[i].v[1];
+        dbuf[3*i+2] = output_buffer[i].v[2];
+    }
+    output_stream__write(system, dbuf, sizeof(double)*3*np);
+    for(i=0; i<np; i++){ dbuf[i] = output_buffer[i].rho; }
+    output_stream__write(system, dbuf, sizeof(double)*np);
+    for(i=0; i<np; i++){ dbuf[i] = output_buffer[i].mass; }
+    output_stream__write(system, dbuf, sizeof(double)*np);
+    for(i=0; i<np; i++){ dbuf[i] = output_buffer[i].bvf_phi; }
+    output_stream__write(system, dbuf, sizeof(double)*np);
+    for(i=0; i<np; i++){ dbuf[i] = output_buffer[i].nu; }
+    output_stream__write(system, dbuf, sizeof(double)*np);
+    if(system->num_chem_species > 0){
+        output_stream__write(system, output_buffer_chem, sizeof(double)*np*system->num_chem_species);
+    }
+    if(num_stoch > 0){
+        output_stream__write(system, output_buffer_xx, sizeof(unsigned int)*np*num_stoch);
+    }
+    fflush(system->output_stream);
+}
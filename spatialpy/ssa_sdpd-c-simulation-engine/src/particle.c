@@ -5,8 +5,12 @@ Copyright 2018 Brian Drawert (UNCA)
 This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
 See the file LICENSE.txt for details.
 ***************************************************************************************** */
+#include "chem_diffusion.h"
+#include "diffusion_masks.h"
 #include "linked_list.h"
 #include "particle.h"
+#include "run_report.h"
+#include "simulate.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
@@ -35,7 +39,8 @@ int add_to_neighbor_list(particle_t*me, particle_t*neighbor, system_t*system){
     double dhr = h - r;
     double wfd = -25.066903536973515383e0 * dhr * dhr * ihsq * ihsq * ihsq * ih; //3D
     // Eq 28 of Drawert et al 2019, Tartakovsky et. al., 2007, JCP
-    double D_i_j = -2.0*(me->mass*neighbor->mass)/(me->mass+neighbor->mass)*(me->rho+neighbor->rho)/(me->rho*neighbor->rho) * r2 * wfd / (r2+0.01*h*h);
+    double rho_j = neighbor->published.rho;
+    double D_i_j = -2.0*(me->mass*neighbor->mass)/(me->mass+neighbor->mass)*(me->rho+rho_j)/(me->rho*rho_j) * r2 * wfd / (r2+0.01*h*h);
     if(isnan(D_i_j)){
         printf("Got NaN calculating D_i_j for me=%i, neighbor=%i\n",me->id, neighbor->id);
         printf("r=%e ",r);
@@ -47,7 +52,7 @@ int add_to_neighbor_list(particle_t*me, particle_t*neighbor, system_t*system){
         printf("me->rho=%e ",p->rho);
         p = neighbor;
         printf("n->mass=%e ",p->mass);
-        printf("n->rho=%e ",p->rho);
+        printf("n->rho=%e ",rho_j);
 
         exit(1);
     }
@@ -188,7 +193,35 @@ system_t* create_system(size_t num_types, size_t num_chem_species, size_t num_ch
     s->boundary_conditions[1] = 'n';
     s->boundary_conditions[2] = 'n';
     s->rdme = NULL;
+    s->chem_rxn_rhs_functions = NULL;
+    s->stoch_rxn_propensity_functions = NULL;
+    s->species_names = NULL;
+    s->subdomain_diffusion_matrix = NULL;
+    s->diffusion_masks = NULL;
+    s->chem_diffusion = NULL;
+    s->implicit_diffusion = 0;
+    s->stoich_irN = NULL;
+    s->stoich_jcN = NULL;
+    s->stoich_prN = NULL;
+    s->thread_pool = NULL;
+    s->run_report = NULL;
     s->static_domain = 0;
+    s->start_step = 0;
+    s->adaptive_dt = 0;
+    s->dt_nominal = 0.0;
+    s->dt_max = 0.0;
+    s->dt_next = 0.0;
+    s->time = 0.0;
+    s->rdme_steps = 1;
+    s->chem_substeps = 1;
+    s->chem_integrator = CHEM_INTEGRATOR_EXPLICIT;
+    s->num_output_threads = 1;
+    s->reduction_freq = 0;
+    s->reduction_axis = 0;
+    s->reduction_nbins = 0;
+    s->reduction = NULL;
+    s->output_stream = NULL;
+    s->checkpoint_freq = 0;
     s->num_stoch_species = num_stoch_species;
     s->num_stoch_rxns = num_stoch_rxns;
     s->num_chem_species = num_chem_species;
@@ -208,6 +241,15 @@ particle_t* create_particle(int id){
     me->solidTag = 0;
     me->x[0] = me->x[1] = me->x[2] = 0.0;
     me->v[0] = me->v[1] = me->v[2] = 0.0;
+    me->vt[0] = me->vt[1] = me->vt[2] = 0.0;
+    me->F[0] = me->F[1] = me->F[2] = 0.0;
+    me->Fbp[0] = me->Fbp[1] = me->Fbp[2] = 0.0;
+    me->normal[0] = me->normal[1] = me->normal[2] = 0.0;
+    me->Frho = 0.0;
+    me->bvf_phi = 0.0;
+    me->rho_filtered = 1;
+    me->xx = NULL;
+    me->rdme = NULL;
     return me;
 }
 
@@ -219,7 +261,89 @@ void add_particle(particle_t* me, system_t* system){
     me->neighbors = create_neighbor_list();
     me->Q = (double*) calloc(system->num_chem_species, sizeof(double));
     me->C = (double*) calloc(system->num_chem_species, sizeof(double));
+    me->published.C = (double*) calloc(system->num_chem_species, sizeof(double));
     me->data_fn = (double*) calloc(system->num_data_fn, sizeof(double));
+    particle__publish(me, system);
+}
+
+void create_particles(system_t*system, size_t num_particles, size_t num_species,
+                      const double*x, const int*type, const double*nu, const double*mass,
+                      const double*rho, const int*solidTag, const unsigned int*u0){
+    size_t i, s;
+    // ids continue after the particles of earlier calls
+    size_t first_id = system->particle_list->count;
+    if(system->rdme != NULL){
+        printf("Error: particles can not be added after the RDME solver is initialized\n");
+        exit(1);
+    }
+    for(i=0; i<num_particles; i++){
+        particle_t* p = create_particle(first_id + i);
+        p->x[0] = x[3*i];
+        p->x[1] = x[3*i+1];
+        p->x[2] = x[3*i+2];
+        p->type = type[i];
+        p->nu = nu[i];
+        p->mass = mass[i];
+        p->rho = rho[i];
+        p->solidTag = solidTag[i];
+        add_particle(p, system);
+        for(s=0; s<system->num_chem_species; s++){
+            p->C[s] = (double) u0[i*num_species+s];
+        }
+        particle__publish(p, system);
+    }
+}
+
+void set_system_domain(system_t*system, const double*domain){
+    system->h = domain[0];
+    system->rho0 = domain[1];
+    system->c0 = domain[2];
+    system->P0 = domain[3];
+    system->xlo = domain[4];
+    system->xhi = domain[5];
+    system->ylo = domain[6];
+    system->yhi = domain[7];
+    system->zlo = domain[8];
+    system->zhi = domain[9];
+    system->gravity[0] = domain[10];
+    system->gravity[1] = domain[11];
+    system->gravity[2] = domain[12];
+}
+
+void particle__publish(particle_t* me, system_t* system){
+    size_t s;
+    particle_state_t* state = &me->published;
+    state->v[0] = me->v[0]; state->v[1] = me->v[1]; state->v[2] = me->v[2];
+    state->vt[0] = me->vt[0]; state->vt[1] = me->vt[1]; state->vt[2] = me->vt[2];
+    state->rho = me->rho;
+    state->nu = me->nu;
+    for(s=0; s<system->num_chem_species; s++){
+        state->C[s] = me->C[s];
+    }
+}
+
+void destroy_system(system_t*system){
+    thread_pool__destroy(system);
+    run_report__destroy(system);
+    destroy_rdme(system);
+    chem_diffusion__destroy(system->chem_diffusion);
+    diffusion_masks__destroy(system->diffusion_masks);
+    node_t*n;
+    for(n=system->particle_list->head; n!=NULL; n=n->next){
+        particle_t*p = n->data;
+        destroy_neighbor_list(p->neighbors);
+        free(p->Q);
+        free(p->C);
+        free(p->published.C);
+        free(p->data_fn);
+        free(p);
+    }
+    destroy_linked_list(system->particle_list);
+    destroy_linked_list(system->x_index);
+    free(system->chem_rxn_rhs_functions);
+    free(system->stoch_rxn_propensity_functions);
+    free(system->gravity);
+    free(system);
 }
 
 double particle_dist(particle_t* p1, particle_t*p2){
@@ -0,0 +1,114 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#include "read_particle_input_file.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary particle input file, native byte order, arrays in particle id order:
+//   header:  char magic[8] = "SPDINPT2", uint32 num_particles, uint32 num_species,
+//            uint32 num_parameters, uint32 reserved
+//   double   domain[SYSTEM_DOMAIN_SIZE] (see set_system_domain())
+//   double   parameters[num_parameters] (default values)
+//   double   x[num_particles][3], nu[num_particles], mass[num_particles],
+//            rho[num_particles]
+//   int32    type[num_particles], solidTag[num_particles]
+//   uint32   u0[num_particles][num_species]
+// The file is mapped copy-on-write, u0 is used in place as the RDME state (p->xx).
+
+#define PARTICLE_INPUT_MAGIC "SPDINPT2"
+
+unsigned int* read_particle_input_file(const char*filename, system_t*system,
+                                       double*parameters, size_t num_parameters){
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0){
+        perror("Error opening particle input file");
+        exit(1);
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0){
+        perror("Error reading particle input file");
+        exit(1);
+    }
+    size_t header_size = 8 + 4*sizeof(uint32_t);
+    if((size_t)st.st_size < header_size){
+        printf("Error: particle input file '%s' is truncated\n", filename);
+        exit(1);
+    }
+    char* data = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED){
+        perror("Error mapping particle input file");
+        exit(1);
+    }
+    close(fd);
+    if(memcmp(data, PARTICLE_INPUT_MAGIC, 8) != 0){
+        printf("Error: '%s' is not a particle input file\n", filename);
+        exit(1);
+    }
+    uint32_t num_particles = ((uint32_t*)(data+8))[0];
+    uint32_t num_species = ((uint32_t*)(data+8))[1];
+    uint32_t num_file_parameters = ((uint32_t*)(data+8))[2];
+    if(num_file_parameters != num_parameters){
+        printf("Error: particle input file '%s' has %u parameters, the model has %li\n",
+                filename, num_file_parameters, (long)num_parameters);
+        exit(1);
+    }
+    size_t np = num_particles;
+    size_t expected_size = header_size + (SYSTEM_DOMAIN_SIZE + num_parameters)*sizeof(double) + np*6*sizeof(double) + np*2*sizeof(int32_t)
+                            + np*num_species*sizeof(uint32_t);
+    if((size_t)st.st_size != expected_size){
+        printf("Error: particle input file '%s' has size %li, expected %li\n",
+                filename, (long)st.st_size, (long)expected_size);
+        exit(1);
+    }
+    if(num_species < system->num_chem_species || num_species < system->num_stoch_species){
+        printf("Error: particle input file '%s' has %u species, the model has %li\n", filename,
+                num_species, (long)(system->num_chem_species > system->num_stoch_species ?
+                system->num_chem_species : system->num_stoch_species));
+        exit(1);
+    }
+    double* domain = (double*)(data + header_size);
+    set_system_domain(system, domain);
+    memcpy(parameters, domain + SYSTEM_DOMAIN_SIZE, num_parameters*sizeof(double));
+    double* x = domain + SYSTEM_DOMAIN_SIZE + num_parameters;
+    double* nu = x + 3*np;
+    double* mass = nu + np;
+    double* rho = mass + np;
+    int32_t* type = (int32_t*)(rho + np);
+    int32_t* solidTag = type + np;
+    unsigned int* u0 = (unsigned int*)(solidTag + np);
+
+    create_particles(system, np, num_species, x, (int*)type, nu, mass, rho, (int*)solidTag, u0);
+    return u0;
+}
+
+static void read_parameter_values__error(const char*values, size_t num_parameters){
+    printf("Error: expected %li comma separated parameter values, got '%s'\n",
+            (long)num_parameters, values);
+    exit(1);
+}
+
+void read_parameter_values(const char*values, double*parameters, size_t num_parameters){
+    char* end = (char*) values;
+    size_t i;
+    for(i=0; i<num_parameters; i++){
+        const char* c = end;
+        if(i > 0){
+            if(*end != ','){ read_parameter_values__error(values, num_parameters); }
+            c = end + 1;
+        }
+        parameters[i] = strtod(c, &end);
+        if(end == c){ read_parameter_values__error(values, num_parameters); }
+    }
+    if(*end != '\0'){ read_parameter_values__error(values, num_parameters); }
+}
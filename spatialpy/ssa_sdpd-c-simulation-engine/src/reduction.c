@@ -0,0 +1,197 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#include "particle.h"
+#include "reduction.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Layout of a partial sum array:
+//   for each type t (types start at 1):
+//       count, sum(rho), sum(v[0]), sum(v[1]), sum(v[2]),
+//       sum(C[s]) for each chem species, sum(xx[s]) for each stoch species
+//   if reduction_nbins > 0, for each bin b along reduction_axis:
+//       sum(C[s]) for each chem species, sum(xx[s]) for each stoch species
+
+#define REDUCTION_PER_TYPE_FIXED 5
+
+// A run that continues an earlier one (restart from a checkpoint, or a second
+// run of the system) appends to the 'reductions.csv' of that run, after
+// dropping its rows at or after the start step, which are taken again.
+// Returns NULL if the file has to be started with a header.
+static FILE* reduction__open_continued(system_t*system){
+    if(system->start_step == 0){
+        return NULL;
+    }
+    FILE* fp = fopen("reductions.csv", "r+");
+    if(fp == NULL){
+        return NULL;
+    }
+    char* line = NULL;
+    size_t line_size = 0;
+    long offset = ftell(fp);
+    int header = 1;
+    while(getline(&line, &line_size, fp) != -1){
+        if(!header && strtoul(line, NULL, 10) >= system->start_step){
+            break;
+        }
+        header = 0;
+        offset = ftell(fp);
+    }
+    free(line);
+    fflush(fp);
+    if(ftruncate(fileno(fp), offset) != 0 || fseek(fp, 0, SEEK_END) != 0){
+        perror("Can't append to 'reductions.csv'");exit(1);
+    }
+    if(header){
+        // empty file
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+void reduction__create(system_t*system, unsigned int num_threads){
+    unsigned int t;
+    int s, b;
+    size_t nspecies = system->num_chem_species + system->num_stoch_species;
+    reduction_t* r = (reduction_t*) malloc(sizeof(reduction_t));
+    r->num_threads = num_threads;
+    r->num_per_type = REDUCTION_PER_TYPE_FIXED + nspecies;
+    r->hist_offset = system->num_types * r->num_per_type;
+    r->num_values = r->hist_offset + system->reduction_nbins * nspecies;
+    r->partial = (double**) malloc(sizeof(double*)*num_threads);
+    for(t=0; t<num_threads; t++){
+        r->partial[t] = (double*) calloc(r->num_values, sizeof(double));
+    }
+    r->total = (double*) calloc(r->num_values, sizeof(double));
+    if(system->reduction_axis == 0){
+        r->hist_lo = system->xlo; r->hist_hi = system->xhi;
+    }else if(system->reduction_axis == 1){
+        r->hist_lo = system->ylo; r->hist_hi = system->yhi;
+    }else{
+        r->hist_lo = system->zlo; r->hist_hi = system->zhi;
+    }
+    system->reduction = r;
+    if((r->fp = reduction__open_continued(system)) != NULL){
+        return;
+    }
+    if((r->fp = fopen("reductions.csv","w+")) == NULL){
+        perror("Can't write 'reductions.csv'");exit(1);
+    }
+    // header
+    fprintf(r->fp, "step,time");
+    for(t=1; t<=system->num_types; t++){
+        fprintf(r->fp, ",count[%u],rho[%u],vx[%u],vy[%u],vz[%u]", t, t, t, t, t);
+        for(s=0; s<system->num_chem_species; s++){
+            fprintf(r->fp, ",C[%s][%u]", system->species_names[s], t);
+        }
+        for(s=0; s<system->num_stoch_species; s++){
+            fprintf(r->fp, ",D[%s][%u]", system->species_names[s], t);
+        }
+    }
+    for(b=0; b<system->reduction_nbins; b++){
+        for(s=0; s<system->num_chem_species; s++){
+            fprintf(r->fp, ",hist_C[%s][%i]", system->species_names[s], b);
+        }
+        for(s=0; s<system->num_stoch_species; s++){
+            fprintf(r->fp, ",hist_D[%s][%i]", system->species_names[s], b);
+        }
+    }
+    fprintf(r->fp, "\n");
+}
+
+void reduction__destroy(system_t*system){
+    unsigned int t;
+    reduction_t* r = system->reduction;
+    if(r == NULL){
+        return;
+    }
+    fclose(r->fp);
+    for(t=0; t<r->num_threads; t++){
+        free(r->partial[t]);
+    }
+    free(r->partial);
+    free(r->total);
+    free(r);
+    system->reduction = NULL;
+}
+
+void reduction__clear(system_t*system, unsigned int thread_id){
+    reduction_t* r = system->reduction;
+    memset(r->partial[thread_id], 0, sizeof(double)*r->num_values);
+}
+
+void reduction__accumulate(particle_t*p, system_t*system, unsigned int thread_id){
+    reduction_t* r = system->reduction;
+    double* sum = r->partial[thread_id];
+    double* tsum = &sum[(p->type - 1) * r->num_per_type];
+    int s;
+    tsum[0] += 1.0;
+    tsum[1] += p->rho;
+    tsum[2] += p->v[0];
+    tsum[3] += p->v[1];
+    tsum[4] += p->v[2];
+    tsum += REDUCTION_PER_TYPE_FIXED;
+    for(s=0; s<system->num_chem_species; s++){
+        tsum[s] += p->C[s];
+    }
+    tsum += system->num_chem_species;
+    if(system->rdme != NULL){
+        for(s=0; s<system->num_stoch_species; s++){
+            tsum[s] += p->xx[s];
+        }
+    }
+    if(system->reduction_nbins > 0){
+        double frac = (p->x[system->reduction_axis] - r->hist_lo) / (r->hist_hi - r->hist_lo);
+        int b = (int)(frac * system->reduction_nbins);
+        if(b < 0){ b = 0; }
+        if(b >= system->reduction_nbins){ b = system->reduction_nbins - 1; }
+        double* hsum = &sum[r->hist_offset + b * (system->num_chem_species + system->num_stoch_species)];
+        for(s=0; s<system->num_chem_species; s++){
+            hsum[s] += p->C[s];
+        }
+        hsum += system->num_chem_species;
+        if(system->rdme != NULL){
+            for(s=0; s<system->num_stoch_species; s++){
+                hsum[s] += p->xx[s];
+            }
+        }
+    }
+}
+
+// Fold the per-thread partial sums and append one row to the output file
+void reduction__write(system_t*system, unsigned int step){
+    reduction_t* r = system->reduction;
+    unsigned int t;
+    size_t i;
+    memset(r->total, 0, sizeof(double)*r->num_values);
+    for(t=0; t<r->num_threads; t++){
+        for(i=0; i<r->num_values; i++){
+            r->total[i] += r->partial[t][i];
+        }
+    }
+    fprintf(r->fp, "%u,%.10e", step, system->time);
+    for(t=0; t<system->num_types; t++){
+        double* tsum = &r->total[t * r->num_per_type];
+        double count = tsum[0];
+        fprintf(r->fp, ",%.0f", count);
+        for(i=1; i<REDUCTION_PER_TYPE_FIXED; i++){
+            fprintf(r->fp, ",%.10e", (count > 0) ? tsum[i] / count : 0.0);
+        }
+        for(i=REDUCTION_PER_TYPE_FIXED; i<r->num_per_type; i++){
+            fprintf(r->fp, ",%.10e", tsum[i]);
+        }
+    }
+    for(i=r->hist_offset; i<r->num_values; i++){
+        fprintf(r->fp, ",%.10e", r->total[i]);
+    }
+    fprintf(r->fp, "\n");
+    fflush(r->fp);
+}
@@ -0,0 +1,106 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#include "rosenbrock.h"
+#include <float.h>
+#include <math.h>
+
+// LU factorization of the row-major n x n matrix A in place, with partial pivoting
+static int rosenbrock__lu(double* A, size_t n, int* pivot){
+    size_t i, j, k;
+    for(k = 0; k < n; k++){
+        size_t p = k;
+        for(i = k + 1; i < n; i++){
+            if(fabs(A[i*n+k]) > fabs(A[p*n+k])){
+                p = i;
+            }
+        }
+        pivot[k] = (int)p;
+        if(A[p*n+k] == 0.0){
+            return -1;
+        }
+        if(p != k){
+            for(j = 0; j < n; j++){
+                double tmp = A[k*n+j];
+                A[k*n+j] = A[p*n+j];
+                A[p*n+j] = tmp;
+            }
+        }
+        for(i = k + 1; i < n; i++){
+            double l = A[i*n+k] / A[k*n+k];
+            A[i*n+k] = l;
+            for(j = k + 1; j < n; j++){
+                A[i*n+j] -= l * A[k*n+j];
+            }
+        }
+    }
+    return 0;
+}
+
+// Solve A x = b with the factors of rosenbrock__lu(), b is overwritten by x
+static void rosenbrock__solve(const double* A, size_t n, const int* pivot, double* b){
+    size_t i, j;
+    for(i = 0; i < n; i++){
+        size_t p = (size_t)pivot[i];
+        if(p != i){
+            double tmp = b[i];
+            b[i] = b[p];
+            b[p] = tmp;
+        }
+        for(j = 0; j < i; j++){
+            b[i] -= A[i*n+j] * b[j];
+        }
+    }
+    for(i = n; i-- > 0; ){
+        for(j = i + 1; j < n; j++){
+            b[i] -= A[i*n+j] * b[j];
+        }
+        b[i] /= A[i*n+i];
+    }
+}
+
+int rosenbrock__step(rosenbrock_rhs_t rhs, void* data, size_t n, double* y, double t, double h,
+                     double* work, int* pivot){
+    const double g = 1.0 + 1.0 / sqrt(2.0);
+    double* W = work;
+    double* f0 = W + n * n;
+    double* k1 = f0 + n;
+    double* k2 = k1 + n;
+    double* yt = k2 + n;
+    size_t i, j;
+    rhs(data, y, t, f0);
+    // W = I - g*h*J, column by column
+    for(j = 0; j < n; j++){
+        double yj = y[j];
+        y[j] = yj + sqrt(DBL_EPSILON) * fmax(fabs(yj), 1.0);
+        double d = y[j] - yj;
+        rhs(data, y, t, k1);
+        y[j] = yj;
+        for(i = 0; i < n; i++){
+            W[i*n+j] = (i == j ? 1.0 : 0.0) - g * h * (k1[i] - f0[i]) / d;
+        }
+    }
+    if(rosenbrock__lu(W, n, pivot) != 0){
+        return -1;
+    }
+    for(i = 0; i < n; i++){
+        k1[i] = f0[i];
+    }
+    rosenbrock__solve(W, n, pivot, k1);
+    for(i = 0; i < n; i++){
+        yt[i] = y[i] + h * k1[i];
+    }
+    rhs(data, yt, t + h, k2);
+    for(i = 0; i < n; i++){
+        k2[i] -= 2.0 * k1[i];
+    }
+    rosenbrock__solve(W, n, pivot, k2);
+    for(i = 0; i < n; i++){
+        y[i] += 1.5 * h * k1[i] + 0.5 * h * k2[i];
+    }
+    return 0;
+}
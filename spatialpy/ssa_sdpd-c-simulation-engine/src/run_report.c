@@ -0,0 +1,134 @@
+/* *****************************************************************************************
+SSA-SDPD simulation engine
+Copyright 2018 Brian Drawert (UNCA)
+
+This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
+See the file LICENSE.txt for details.
+***************************************************************************************** */
+#include "particle.h"
+#include "run_report.h"
+#include "simulate_rdme.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+__thread run_timer_t* run_timer__current = NULL;
+
+static const char* run_phase_names[RUN_NUM_PHASES] = {
+    "sort", "neighbor_search", "take_step1", "pairwise_force", "take_step2",
+    "barrier_wait", "rdme", "diffusion", "output_sync", "output_async"
+};
+
+void run_report__begin(system_t*system, unsigned int num_threads, const char*threads_reason){
+    run_report__destroy(system);
+    run_report_t* report = (run_report_t*) malloc(sizeof(run_report_t));
+    report->num_threads = num_threads;
+    snprintf(report->threads_reason, sizeof(report->threads_reason), "%s", threads_reason);
+    report->timers = (run_timer_t*) calloc(num_threads+3, sizeof(run_timer_t));
+    if(report->timers == NULL){
+        perror("Error allocating the run report");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &report->start);
+    report->wall_seconds = 0.0;
+    report->start_step = system->start_step;
+    report->end_step = system->start_step;
+    report->end_time = system->time;
+    report->rdme_reactions = 0;
+    report->rdme_diffusions = 0;
+    report->rdme_heap_updates = 0;
+    if(system->rdme != NULL){
+        // the counters of the NSM solver are not reset between runs
+        report->rdme_reactions = -system->rdme->total_reactions;
+        report->rdme_diffusions = -system->rdme->total_diffusion;
+        report->rdme_heap_updates = -system->rdme->total_heap_updates;
+    }
+    system->run_report = report;
+}
+
+void run_report__end(system_t*system, unsigned int end_step){
+    run_report_t* report = system->run_report;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report->wall_seconds = (end.tv_sec - report->start.tv_sec) + 1e-9*(end.tv_nsec - report->start.tv_nsec);
+    report->end_step = end_step;
+    report->end_time = system->time;
+    if(system->rdme != NULL){
+        report->rdme_reactions += system->rdme->total_reactions;
+        report->rdme_diffusions += system->rdme->total_diffusion;
+        report->rdme_heap_updates += system->rdme->total_heap_updates;
+    }
+}
+
+void run_report__destroy(system_t*system){
+    if(system->run_report == NULL){
+        return;
+    }
+    free(system->run_report->timers);
+    free(system->run_report);
+    system->run_report = NULL;
+}
+
+static void run_report__write_seconds(FILE*fp, const double*seconds){
+    int p;
+    fprintf(fp, "{");
+    for(p=0; p<RUN_NUM_PHASES; p++){
+        fprintf(fp, "%s\"%s\": %.9g", p==0 ? "" : ", ", run_phase_names[p], seconds[p]);
+    }
+    fprintf(fp, "}");
+}
+
+void run_report__write(system_t*system, const char*filename){
+    run_report_t* report = system->run_report;
+    if(report == NULL){
+        printf("Error: no run to report\n");
+        exit(1);
+    }
+    FILE*fp;
+    if((fp = fopen(filename, "w")) == NULL){
+        perror("Can't write the run report");
+        exit(1);
+    }
+    unsigned int num_timers = report->num_threads + 3;
+    double total[RUN_NUM_PHASES] = {0};
+    unsigned long neighbor_pairs = 0;
+    unsigned int t;
+    int p;
+    for(t=0; t<num_timers; t++){
+        for(p=0; p<RUN_NUM_PHASES; p++){
+            total[p] += report->timers[t].seconds[p];
+        }
+        neighbor_pairs += report->timers[t].neighbor_pairs;
+    }
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"num_threads\": %u,\n", report->num_threads);
+    fprintf(fp, "  \"threads_reason\": \"%s\",\n", report->threads_reason);
+    fprintf(fp, "  \"num_particles\": %lu,\n", (unsigned long)system->particle_list->count);
+    fprintf(fp, "  \"start_step\": %u,\n", report->start_step);
+    fprintf(fp, "  \"end_step\": %u,\n", report->end_step);
+    fprintf(fp, "  \"end_time\": %.17g,\n", report->end_time);
+    fprintf(fp, "  \"wall_seconds\": %.9g,\n", report->wall_seconds);
+    // thread seconds of each phase, summed over all threads
+    fprintf(fp, "  \"phases\": ");
+    run_report__write_seconds(fp, total);
+    fprintf(fp, ",\n  \"threads\": [\n");
+    for(t=0; t<num_timers; t++){
+        const char* role = "worker";
+        if(t == report->num_threads){
+            role = "main";
+        }else if(t == report->num_threads+1){
+            role = "sort";
+        }else if(t == report->num_threads+2){
+            role = "output";
+        }
+        fprintf(fp, "    {\"role\": \"%s\", \"id\": %u, \"seconds\": ", role,
+                t < report->num_threads ? t : 0);
+        run_report__write_seconds(fp, report->timers[t].seconds);
+        fprintf(fp, "}%s\n", t+1 < num_timers ? "," : "");
+    }
+    fprintf(fp, "  ],\n");
+    fprintf(fp, "  \"counters\": {\"neighbor_pairs\": %lu, \"rdme_reactions\": %li, "
+                "\"rdme_diffusions\": %li, \"rdme_heap_updates\": %li}\n",
+            neighbor_pairs, report->rdme_reactions, report->rdme_diffusions, report->rdme_heap_updates);
+    fprintf(fp, "}\n");
+    fclose(fp);
+}
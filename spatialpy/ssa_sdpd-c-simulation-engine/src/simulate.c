@@ -11,6 +11,7 @@ See the file LICENSE.txt for details.
 #include "particle.h"
 #include "simulate_rdme.h"
 #include "model.h"
+#include "run_report.h"
 #include <errno.h>
 #include "pthread_barrier.h"
 #include <signal.h>
@@ -38,15 +39,46 @@ unsigned int get_number_of_substeps(){
     return 3;
 }
 
+// The forces read the state the neighbors published at the end of
+// take_step1() (particle_t.published), so take_step2() of a particle can
+// follow its compute_forces() while the others still compute theirs: the
+// workers only wait for each other after the predictor and at the end of
+// the step.
+int substep_ends_phase(unsigned int substep){
+    return substep != 1;
+}
+
+unsigned int get_number_of_phases(){
+    unsigned int substep, phases = 0;
+    for(substep=0; substep < get_number_of_substeps(); substep++){
+        phases += substep_ends_phase(substep);
+    }
+    return phases;
+}
+
+// find_neighbors() timed and counted for the run report of a worker thread
+static void find_neighbors__timed(particle_t* me, system_t* system){
+    run_timer_t* timer = run_timer__current;
+    if(timer == NULL){
+        find_neighbors(me, system);
+        return;
+    }
+    double start = run_timer__now();
+    find_neighbors(me, system);
+    run_timer__add(timer, RUN_PHASE_NEIGHBOR_SEARCH, start);
+    timer->neighbor_pairs += me->neighbors->count;
+}
+
 
 // Step 1/3: First part of time step computation
 void take_step1(particle_t* me, system_t* system, unsigned int step) {
     int i;
     //printf("particle id=%i Q[0]=%e\n",me->id,me->Q[0]);
 
-    // Step 1.1: 
-    if(step==0 || system->static_domain == 0){
-        find_neighbors(me, system);
+    // Step 1.1: Find nearest neighbors, on the first step (compute_forces()
+    // searches again after the particles moved)
+    if(step==system->start_step){
+        find_neighbors__timed(me, system);
     }
 
     // Step 1.2: Predictor step
@@ -89,7 +121,9 @@ void take_step1(particle_t* me, system_t* system, unsigned int step) {
         me->Q[i] = 0.0;
     }
 
-
+    // Step 1.3: Publish the predicted state, read by the force computation
+    // of the neighbors while this particle takes its corrector step
+    particle__publish(me, system);
 }
 
 // Step 2/3: Update the 'F' field of each partile attached to a bond
@@ -101,16 +135,39 @@ void take_step1(particle_t* me, system_t* system, unsigned int step) {
 void compute_forces(particle_t* me, system_t* system, unsigned int step) {
 
     //printf("compute_forces() particle id=%i Q[0]=%e\n",me->id,me->Q[0]);
+    if(particle_role(me, system) == PARTICLE_ROLE_WALL){
+        compute_forces_wall(me, system, step);
+        return;
+    }
     // Step 2.2: Find nearest neighbors
     if(step>0 && system->static_domain == 0){
-        find_neighbors(me, system);
+        find_neighbors__timed(me, system);
     }
 
-    // Step 2.3: Compute forces
-    pairwiseForce(me, system);
+    // Step 2.3: Compute forces, and in the same pass over the neighbors the
+    // density filter and the boundary volume fraction of take_step2()
+    int fuse = 0;
+    if (system->static_domain == 0) {
+        if (step % 20 == 0) {
+            fuse |= FUSE_FILTER_DENSITY;
+        }
+        if (me->solidTag == 0) {
+            fuse |= FUSE_BOUNDARY_VOLUME_FRACTION;
+        }
+    }
+    pairwiseForceFused(me, system, fuse);
 
 }
 
+// Step 2/3 of a fixed solid particle: its forces are not used, only the
+// density filter of take_step2() and the chemistry flux are computed
+void compute_forces_wall(particle_t* me, system_t* system, unsigned int step) {
+    if(step>0){
+        find_neighbors__timed(me, system);
+    }
+    pairwiseForceWall(me, system, step % 20 == 0);
+}
+
 
 // Step 3/3: Compute the final state
 void take_step2(particle_t* me, system_t* system, unsigned int step)
@@ -126,7 +183,7 @@ void take_step2(particle_t* me, system_t* system, unsigned int step)
 
         // Update density using continuity equation and Shepard filter 
         if (step % 20 == 0) {
-            filterDensity(me, system);
+            me->rho = me->rho_filtered;
         }
         me->rho = me->rho + 0.5 * system->dt * me->Frho;
 
@@ -134,15 +191,17 @@ void take_step2(particle_t* me, system_t* system, unsigned int step)
     }else if (me->solidTag == 1 && system->static_domain == 0) {
         // Filter density field (for fixed solid particles)
         if (step % 20 == 0) {
-            filterDensity(me, system);
+            me->rho = me->rho_filtered;
         }
     }
 
 
-    // Step 3.2: Compute boundary volume fractions (bvf)
+    // Step 3.2: Compute boundary volume fractions (bvf), done by compute_forces()
     // Step 3.3: Apply BVF 
     if (me->solidTag == 0 && system->static_domain == 0) {
-        computeBoundaryVolumeFraction(me,system);
+        for (i = 0; i < system->dimension; i++) {
+            me->vt[i] = 0.0;
+        }
         applyBoundaryVolumeFraction(me, system);
     }
 
@@ -151,6 +210,9 @@ void take_step2(particle_t* me, system_t* system, unsigned int step)
     for(i=0; i< system->num_chem_species; i++){
         me->C[i] += me->Q[i] * system->dt * 0.5;
     }
+    if(chemRxnsSplit(system)){
+        integrateChemRxns(me, system);
+    }
     // Apply boundary conditions
     applyBoundaryConditions(me, system);
 
@@ -6,6 +6,7 @@ This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Ve
 See the file LICENSE.txt for details.
 ***************************************************************************************** */
 #include "linked_list.h"
+#include "diffusion_masks.h"
 #include <time.h>
 #include "output.h"
 #include "particle.h"
@@ -40,8 +41,8 @@ void initialize_rdme(system_t*system, size_t *irN, size_t *jcN,int *prN,size_t *
 
 /**************************************************************************/
 // This function get called by the main simulation loop.  It advances the
-// state the of RDME system by dt
-void simulate_rdme(system_t*system,unsigned int step){
+// state the of RDME system from time t by dt
+void simulate_rdme(system_t*system, double t, double dt){
     rdme_t*rdme = system->rdme;
     if(rdme == NULL){
         return;
@@ -69,8 +70,8 @@ void simulate_rdme(system_t*system,unsigned int step){
         if(debug_flag) printf("\tnsm_core__initialize_heap\n");
         nsm_core__initialize_heap(system);
     }
-    if(debug_flag) printf("Simulating RDME for %e seconds\n",system->dt);
-    nsm_core__take_step(system, system->dt*step, system->dt);
+    if(debug_flag) printf("Simulating RDME for %e seconds\n",dt);
+    nsm_core__take_step(system, t, dt);
 }
 /**************************************************************************/
 void destroy_rdme(system_t*system){
@@ -79,7 +80,18 @@ void destroy_rdme(system_t*system){
     }
     if(debug_flag) printf("NSM: total # reacton events %lu\n",system->rdme->total_reactions);
     if(debug_flag) printf("NSM: total # diffusion events %lu\n",system->rdme->total_diffusion);
+    node_t*n;
+    for(n=system->particle_list->head; n!=NULL; n=n->next){
+        particle_t*p = n->data;
+        if(p->rdme != NULL){
+            free(p->rdme->rrate);
+            free(p->rdme->Ddiag);
+            free(p->rdme);
+            p->rdme = NULL;
+        }
+    }
     nsm_core__destroy(system->rdme);
+    system->rdme = NULL;
 }
 
 
@@ -202,6 +214,7 @@ void nsm_core__create(system_t*system, size_t *irN, size_t *jcN,int *prN, size_t
     rdme->jcG = jcG;
     rdme->total_reactions = 0;
     rdme->total_diffusion = 0;
+    rdme->total_heap_updates = 0;
     rdme->initialized = 0;
 
     rdme->heap = create_ordered_list();
@@ -295,7 +308,9 @@ void nsm_core__initialize_diff_propensities(system_t* system){
     node_t*n;
     neighbor_node_t*n2;
     particle_t*p,*p2;
-    double diff_const;
+    size_t a;
+    diffusion_masks__build(system);
+    const diffusion_masks_t* masks = system->diffusion_masks;
     for(n=system->particle_list->head; n!=NULL; n=n->next){
         p=n->data;
         if(p->neighbors->count == 0){
@@ -304,11 +319,15 @@ void nsm_core__initialize_diff_propensities(system_t* system){
         p->rdme->sdrate = 0.0;
         for(s_ndx=0; s_ndx<system->num_stoch_species; s_ndx++){
             p->rdme->Ddiag[s_ndx] = 0.0;  //Ddiag is sum of (diff_const*n2->D_i_j)
-            for(n2=p->neighbors->head; n2!=NULL; n2=n2->next){
-                p2 = n2->data;
-                diff_const = system->subdomain_diffusion_matrix[s_ndx*system->num_types + (p2->type-1)];
-                p->rdme->Ddiag[s_ndx] += diff_const*n2->D_i_j;
+        }
+        // one pass over the neighbors, each adds to the species that diffuse into it
+        for(n2=p->neighbors->head; n2!=NULL && masks!=NULL; n2=n2->next){
+            p2 = n2->data;
+            for(a = masks->type_ptr[p2->type-1]; a < masks->type_ptr[p2->type]; a++){
+                p->rdme->Ddiag[masks->species[a]] += masks->D[a]*n2->D_i_j;
             }
+        }
+        for(s_ndx=0; s_ndx<system->num_stoch_species; s_ndx++){
             p->rdme->sdrate += p->rdme->Ddiag[s_ndx] * p->xx[s_ndx];
         }
     }
@@ -334,6 +353,7 @@ void nsm_core__initialize_heap(system_t*system){
 
 /**************************************************************************/
 void nsm_core__destroy(rdme_t*rdme){
+    destroy_ordered_list(rdme->heap);
     free(rdme);
 }
 
@@ -797,6 +817,7 @@ void nsm_core__take_step(system_t*system, double current_time, double step_size)
         /* Update the heap. */
         //update(0,rdme->rtimes,rdme->node,rdme->heap,rdme->Ncells);
         ordered_list_bubble_up_down(system->rdme->heap, subvol->rdme->heap_index);
+        system->rdme->total_heap_updates++; /* counter */
 
         /* If it was a diffusion event, also update the other affected
          node. */
@@ -816,6 +837,7 @@ void nsm_core__take_step(system_t*system, double current_time, double step_size)
             }
 
             ordered_list_bubble_up_down(system->rdme->heap, dest_subvol->rdme->heap_index);
+            system->rdme->total_heap_updates++; /* counter */
         }
 
         // re-sort the heap
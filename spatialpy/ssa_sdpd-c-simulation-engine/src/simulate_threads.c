@@ -5,97 +5,291 @@ Copyright 2018 Brian Drawert (UNCA)
 This program is distributed under the terms of the GNU GENERAL PUBLIC LICENSE Version 3.
 See the file LICENSE.txt for details.
 ***************************************************************************************** */
+#include "checkpoint.h"
+#include "chem_diffusion.h"
+#include "count_cores.h"
+#include "diffusion_masks.h"
+#include "dt_control.h"
 #include "linked_list.h"
 #include "model.h"
 #include "output.h"
 #include "particle.h"
+#include "reduction.h"
+#include "run_report.h"
 #include "simulate.h"
 #include "simulate_rdme.h"
 #include <errno.h>
+#include <math.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 
 
 struct arg {
-    system_t* system;
+    thread_pool_t* pool;
     unsigned int thread_id;
     unsigned int num_threads;
     unsigned int num_my_particles;
     //unsigned int num_my_bonds;
     node_t*my_first_particle;
     //bond*my_first_bond;
+    // the particles above by role, in list order, see worker__assign_roles()
+    particle_t** role_particles[PARTICLE_NUM_ROLES];
+    unsigned int num_role_particles[PARTICLE_NUM_ROLES];
+    particle_t** role_buffer;
+    dt_limits_t dt_limits;  // of the last step, for the adaptive time step
 };
 
-pthread_barrier_t begin_step_barrier;
-pthread_barrier_t end_step_barrier;
-pthread_barrier_t begin_sort_barrier;
-pthread_barrier_t end_sort_barrier;
-pthread_barrier_t begin_output_barrier;
-pthread_barrier_t end_output_barrier;
-unsigned int current_step;
+struct sarg {
+    thread_pool_t* pool;
+    linked_list_t*ll;
+    int sort_ndx;
+};
+
+// Threads of a system: the workers, the sort thread and the output thread.
+// They are created by the first run_simulation() of the system and park on
+// begin_run_barrier between runs until thread_pool__destroy().
+struct __thread_pool_t {
+    system_t* system;
+    unsigned int num_workers;
+    struct arg* worker_args;
+    pthread_t* worker_handles;
+    struct sarg sort_args;
+    pthread_t sort_handle;
+    pthread_t output_handle;
+    // workers + sort + output + main thread
+    pthread_barrier_t begin_run_barrier;
+    pthread_barrier_t end_run_barrier;
+    // workers + main thread
+    pthread_barrier_t begin_step_barrier;
+    pthread_barrier_t end_step_barrier;
+    // sort or output thread + main thread
+    pthread_barrier_t begin_sort_barrier;
+    pthread_barrier_t end_sort_barrier;
+    pthread_barrier_t begin_output_barrier;
+    pthread_barrier_t end_output_barrier;
+    // Set by the main thread before begin_run_barrier, the threads return
+    int shutdown;
+    // Set by the main thread at the end of a run, the worker, sort and output
+    // threads park when they are released next.  They have all read it once
+    // they reach end_run_barrier, the next run may then clear it.
+    int run_finished;
+    // Set by the main thread before begin_step_barrier
+    int reduction_due;
+    // What the output thread does when it is released, set before begin_output_barrier
+    unsigned int current_step;
+    unsigned int output_step;  // number of the snapshot, a multiple of output_freq
+    int output_snapshot;
+    int output_checkpoint;
+};
 
 void* output_system_thread(void* targ){
-    system_t* system = (system_t*) targ;
+    thread_pool_t* pool = (thread_pool_t*) targ;
+    system_t* system = pool->system;
     while(1){
-        pthread_barrier_wait(&begin_output_barrier);
-        //output_csv(system, current_step);
-        if(debug_flag) printf("[OUT] start output_vtk__sync_step()\n");
-        output_vtk__sync_step(system, current_step);
-        if(debug_flag) printf("[OUT] done output_vtk__sync_step()\n");
-        pthread_barrier_wait(&end_output_barrier);
-        if(debug_flag) printf("[OUT] start output_vtk__async_step()\n");
-        output_vtk__async_step(system);
-        if(debug_flag) printf("[OUT] done output_vtk__async_step()\n");
+        pthread_barrier_wait(&pool->begin_run_barrier);
+        if(pool->shutdown){
+            return NULL;
+        }
+        while(1){
+            pthread_barrier_wait(&pool->begin_output_barrier);
+            if(pool->run_finished){
+                break;
+            }
+            run_timer_t* timer = RUN_TIMER_OUTPUT(system->run_report);
+            double start = run_timer__now();
+            int snapshot = pool->output_snapshot;
+            int checkpoint = pool->output_checkpoint;
+            //output_csv(system, current_step);
+            if(snapshot){
+                if(debug_flag) printf("[OUT] start output_vtk__sync_step()\n");
+                output_vtk__sync_step(system, pool->output_step);
+                if(debug_flag) printf("[OUT] done output_vtk__sync_step()\n");
+            }
+            if(checkpoint){
+                checkpoint__sync_step(system, pool->current_step);
+            }
+            start = run_timer__add(timer, RUN_PHASE_OUTPUT_SYNC, start);
+            pthread_barrier_wait(&pool->end_output_barrier);
+            start = run_timer__now();
+            if(checkpoint){
+                checkpoint__async_step(system);
+            }
+            if(snapshot && system->output_stream != NULL){
+                output_stream__async_step(system);
+            }else if(snapshot){
+                if(debug_flag) printf("[OUT] start output_vtk__async_step()\n");
+                output_vtk__async_step(system);
+                if(debug_flag) printf("[OUT] done output_vtk__async_step()\n");
+            }
+            run_timer__add(timer, RUN_PHASE_OUTPUT_ASYNC, start);
+        }
+        pthread_barrier_wait(&pool->end_run_barrier);
     }
 }
 
-struct sarg {
-    linked_list_t*ll;
-    int sort_ndx;
-};
+// Release the output thread and wait until it has copied the state.  It
+// then writes the output while the simulation continues.
+void release_output_thread(thread_pool_t* pool, unsigned int step, unsigned int output_step, int snapshot, int checkpoint){
+    pool->current_step = step;
+    pool->output_step = output_step;
+    pool->output_snapshot = snapshot;
+    pool->output_checkpoint = checkpoint;
+    if(debug_flag) printf("[%i] Starting the Output threads\n",step);
+    pthread_barrier_wait(&pool->begin_output_barrier);
+    // Wait until output threads are done
+    pthread_barrier_wait(&pool->end_output_barrier);
+    if(debug_flag) printf("[%i] Output threads finished\n",step);
+}
 
 void* sort_index_thread(void* targ_in){
     struct sarg* targ = (struct sarg*) targ_in;
+    thread_pool_t* pool = targ->pool;
     while(1){
-        pthread_barrier_wait(&begin_sort_barrier);
-        if(debug_flag) printf("[SORT] begin sort\n");
-        linked_list_sort(targ->ll,targ->sort_ndx);
-        if(debug_flag) printf("[SORT] sort complete\n");
-        pthread_barrier_wait(&end_sort_barrier);
+        pthread_barrier_wait(&pool->begin_run_barrier);
+        if(pool->shutdown){
+            return NULL;
+        }
+        while(1){
+            pthread_barrier_wait(&pool->begin_sort_barrier);
+            if(pool->run_finished){
+                break;
+            }
+            if(debug_flag) printf("[SORT] begin sort\n");
+            double start = run_timer__now();
+            linked_list_sort(targ->ll,targ->sort_ndx);
+            run_timer__add(RUN_TIMER_SORT(pool->system->run_report), RUN_PHASE_SORT, start);
+            if(debug_flag) printf("[SORT] sort complete\n");
+            pthread_barrier_wait(&pool->end_sort_barrier);
+        }
+        pthread_barrier_wait(&pool->end_run_barrier);
     }
 }
 
-void* run_simulation_thread(void *targ_in){
-    struct arg* targ = (struct arg*)targ_in;
-    system_t* system = targ->system;
+// Build the work lists of the particles of a worker by role, each list a
+// contiguous part of targ->role_buffer, and publish the state of the
+// particles as left by the last run or the checkpoint
+static void worker__assign_roles(struct arg* targ, system_t* system){
+    unsigned int i, r;
+    unsigned int next[PARTICLE_NUM_ROLES];
+    node_t* n;
+    particle_t** buffer = realloc(targ->role_buffer, sizeof(particle_t*) * (targ->num_my_particles > 0 ? targ->num_my_particles : 1));
+    if(buffer == NULL){
+        perror("Error allocating the work lists of a worker thread");
+        exit(1);
+    }
+    targ->role_buffer = buffer;
+    for(r=0; r < PARTICLE_NUM_ROLES; r++){
+        targ->num_role_particles[r] = 0;
+    }
+    n = targ->my_first_particle;
+    for(i=0; i < targ->num_my_particles && n != NULL; i++, n=n->next){
+        targ->num_role_particles[particle_role(n->data, system)]++;
+        particle__publish(n->data, system);
+    }
+    for(r=0, i=0; r < PARTICLE_NUM_ROLES; r++){
+        targ->role_particles[r] = buffer + i;
+        next[r] = 0;
+        i += targ->num_role_particles[r];
+    }
+    n = targ->my_first_particle;
+    for(i=0; i < targ->num_my_particles && n != NULL; i++, n=n->next){
+        particle_role_t r = particle_role(n->data, system);
+        targ->role_particles[r][next[r]++] = n->data;
+    }
+}
+
+static void run_simulation_thread__run(struct arg* targ){
+    thread_pool_t* pool = targ->pool;
+    system_t* system = pool->system;
     unsigned int step;
     node_t*n;
     int i;
     int count = 0;
-    // each thread will take a step with each of it's particles
-    for(step=0; step < system->nt; step++){
+    // substep 1 is the force computation
+    static const run_phase_t substep_phases[3] = {
+        RUN_PHASE_TAKE_STEP1, RUN_PHASE_PAIRWISE_FORCE, RUN_PHASE_TAKE_STEP2
+    };
+    run_timer_t* timer = &system->run_report->timers[targ->thread_id];
+    run_timer__current = timer;
+    // each thread will take a step with each of it's particles, until the
+    // main thread ends the run
+    for(step=system->start_step; ; step++){
         // block on the begin barrier
         if(debug_flag) printf("[WORKER %i] waiting to begin step %i\n",targ->thread_id,step);
-        pthread_barrier_wait(&begin_step_barrier);
+        double start = run_timer__now();
+        pthread_barrier_wait(&pool->begin_step_barrier);
+        start = run_timer__add(timer, RUN_PHASE_BARRIER_WAIT, start);
+        if(pool->run_finished){
+            break;
+        }
         //---------------------------------------
-        unsigned int nsubsteps = get_number_of_substeps();
-        for(int substep=0;substep < nsubsteps; substep++){
-            // take_step
-            count = 0;
+        // in-situ reductions, folded by the main thread after the first phase
+        if(pool->reduction_due){
+            reduction__clear(system, targ->thread_id);
             n=targ->my_first_particle;
             for(i=0; i<targ->num_my_particles; i++){
                 if(n==NULL) break;
-                take_step(n->data,system,step,substep);
-                count++;
+                reduction__accumulate(n->data, system, targ->thread_id);
                 n=n->next;
             }
-            // block on the end barrier
+        }
+        unsigned int nsubsteps = get_number_of_substeps();
+        for(int substep=0;substep < nsubsteps; substep++){
+            // take_step
+            count = 0;
+            double neighbor_seconds = timer->seconds[RUN_PHASE_NEIGHBOR_SEARCH];
+            // the limits of the next adaptive time step are taken with the last substep
+            int dt_limits = system->adaptive_dt && substep == nsubsteps-1;
+            if(dt_limits){
+                dt_limits__clear(&targ->dt_limits);
+            }
+            if(substep==0){
+                // the predictor moves particles while the neighbor search of
+                // the first step reads their positions, so keep the list order
+                n=targ->my_first_particle;
+                for(i=0; i<targ->num_my_particles; i++){
+                    if(n==NULL) break;
+                    take_step1(n->data,system,step);
+                    count++;
+                    n=n->next;
+                }
+            }else{
+                // the other substeps only write the particle itself and read
+                // the published state of the neighbors: run them over the work
+                // list of each role
+                for(int role=0; role < PARTICLE_NUM_ROLES; role++){
+                    particle_t** particles = targ->role_particles[role];
+                    unsigned int num_particles = targ->num_role_particles[role];
+                    for(i=0; i<num_particles; i++){
+                        if(substep==2){
+                            take_step2(particles[i],system,step);
+                        }else if(role==PARTICLE_ROLE_WALL){
+                            compute_forces_wall(particles[i],system,step);
+                        }else{
+                            compute_forces(particles[i],system,step);
+                        }
+                        if(dt_limits && role!=PARTICLE_ROLE_WALL){
+                            dt_limits__accumulate(&targ->dt_limits, particles[i]);
+                        }
+                    }
+                    count += num_particles;
+                }
+            }
+            // the neighbor search is timed by take_step()
+            start = run_timer__add(timer, substep_phases[substep], start);
+            timer->seconds[substep_phases[substep]] -= timer->seconds[RUN_PHASE_NEIGHBOR_SEARCH] - neighbor_seconds;
             if(debug_flag)printf("[WORKER %i] completed step %i, substep %i/%i, processed %i particles\n",targ->thread_id,step,substep,nsubsteps,count);
-            pthread_barrier_wait(&end_step_barrier);
+            // block on the end barrier, unless the next substep only reads
+            // the published state of the other particles
+            if(substep_ends_phase(substep)){
+                pthread_barrier_wait(&pool->end_step_barrier);
+                start = run_timer__add(timer, RUN_PHASE_BARRIER_WAIT, start);
+            }
         }
         //---------------------------------------
         // compute_bond_forces
@@ -114,32 +308,324 @@ void* run_simulation_thread(void *targ_in){
         */
         //---------------------------------------
     } //end for(step)
+    run_timer__current = NULL;
+}
+
+void* run_simulation_thread(void *targ_in){
+    struct arg* targ = (struct arg*)targ_in;
+    thread_pool_t* pool = targ->pool;
+    while(1){
+        pthread_barrier_wait(&pool->begin_run_barrier);
+        if(pool->shutdown){
+            return NULL;
+        }
+        run_simulation_thread__run(targ);
+        pthread_barrier_wait(&pool->end_run_barrier);
+    }
+}
+
+static thread_pool_t* thread_pool__create(system_t* system, unsigned int num_workers){
+    thread_pool_t* pool = (thread_pool_t*) calloc(1, sizeof(thread_pool_t));
+    if(pool == NULL){
+        perror("Error allocating the thread pool");
+        exit(1);
+    }
+    pool->system = system;
+    pool->num_workers = num_workers;
+    pool->worker_args = (struct arg*) malloc(sizeof(struct arg)*num_workers);
+    pool->worker_handles = (pthread_t*) malloc(sizeof(pthread_t)*num_workers);
+    pthread_barrier_init(&pool->begin_run_barrier, NULL, num_workers+3);
+    pthread_barrier_init(&pool->end_run_barrier, NULL, num_workers+3);
+    // create barrier that unblocks when "num_threads+1" call wait() on it
+    pthread_barrier_init(&pool->begin_step_barrier, NULL, num_workers+1);
+    pthread_barrier_init(&pool->end_step_barrier, NULL, num_workers+1);
+    pthread_barrier_init(&pool->begin_sort_barrier, NULL, 2);
+    pthread_barrier_init(&pool->end_sort_barrier, NULL, 2);
+    pthread_barrier_init(&pool->begin_output_barrier, NULL, 2);
+    pthread_barrier_init(&pool->end_output_barrier, NULL, 2);
+    unsigned int i;
+    for(i=0; i < num_workers; i++){
+        pool->worker_args[i].pool = pool;
+        pool->worker_args[i].num_threads = num_workers;
+        pool->worker_args[i].thread_id = i;
+        pool->worker_args[i].role_buffer = NULL;
+        if(debug_flag) printf("Creating worker thread %i\n", i);
+        pthread_create(&pool->worker_handles[i], NULL, run_simulation_thread, &pool->worker_args[i]);
+    }
+    // Create threads to sort indexes
+    pool->sort_args.pool = pool;
+    pool->sort_args.ll = system->x_index;
+    pool->sort_args.sort_ndx = 0;
+    if(debug_flag) printf("Creating thread to update x-position index\n");
+    pthread_create(&pool->sort_handle, NULL, sort_index_thread, &pool->sort_args);
+    // Create thread to handle output
+    if(debug_flag) printf("Creating thread to create output files\n");
+    pthread_create(&pool->output_handle, NULL, output_system_thread, pool);
+    return pool;
+}
+
+void thread_pool__destroy(system_t* system){
+    thread_pool_t* pool = system->thread_pool;
+    if(pool == NULL){
+        return;
+    }
+    // Release the parked threads to return and wait for all of them
+    if(debug_flag) printf("Cleaning up threads\n");
+    pool->shutdown = 1;
+    pthread_barrier_wait(&pool->begin_run_barrier);
+    pthread_join(pool->sort_handle, NULL);
+    pthread_join(pool->output_handle, NULL);
+    unsigned int i;
+    for(i=0; i < pool->num_workers; i++){
+        pthread_join(pool->worker_handles[i], NULL);
+    }
+    pthread_barrier_destroy(&pool->begin_run_barrier);
+    pthread_barrier_destroy(&pool->end_run_barrier);
+    pthread_barrier_destroy(&pool->begin_step_barrier);
+    pthread_barrier_destroy(&pool->end_step_barrier);
+    pthread_barrier_destroy(&pool->begin_sort_barrier);
+    pthread_barrier_destroy(&pool->end_sort_barrier);
+    pthread_barrier_destroy(&pool->begin_output_barrier);
+    pthread_barrier_destroy(&pool->end_output_barrier);
+    for(i=0; i < pool->num_workers; i++){
+        free(pool->worker_args[i].role_buffer);
+    }
+    free(pool->worker_handles);
+    free(pool->worker_args);
+    free(pool);
+    system->thread_pool = NULL;
+}
+
+// Thread count autotuning: threads are capped by the usable CPUs and the
+// particle count, then the neighbor search and force kernel of the first
+// step is timed with 1, 2, 4, ... threads.
+#define AUTOTUNE_MIN_PARTICLES_PER_THREAD 250
+#define AUTOTUNE_PROBE_REPEATS 2
+// Skip the probe when it would cost more than about 1/AUTOTUNE_MIN_STEPS_PER_PROBE of the run
+#define AUTOTUNE_MIN_STEPS_PER_PROBE 10
+
+struct probe_arg {
+    system_t* system;
+    unsigned int num_my_particles;
+    node_t*my_first_particle;
+};
+
+void* probe_thread(void *targ_in){
+    struct probe_arg* targ = (struct probe_arg*)targ_in;
+    system_t* system = targ->system;
+    double F[3], Fbp[3], Frho;
+    double* Q = (double*) malloc(sizeof(double)*(system->num_chem_species+1));
+    node_t*n = targ->my_first_particle;
+    unsigned int i;
+    int k;
+    for(i=0; i<targ->num_my_particles && n!=NULL; i++, n=n->next){
+        particle_t* p = n->data;
+        // the neighbor lists are rebuilt by the first step, the force
+        // accumulators are restored so the probe leaves the state unchanged
+        for(k=0; k<3; k++){ F[k] = p->F[k]; Fbp[k] = p->Fbp[k]; }
+        Frho = p->Frho;
+        for(k=0; k<system->num_chem_species; k++){ Q[k] = p->Q[k]; }
+        find_neighbors(p, system);
+        pairwiseForce(p, system);
+        for(k=0; k<3; k++){ p->F[k] = F[k]; p->Fbp[k] = Fbp[k]; }
+        p->Frho = Frho;
+        for(k=0; k<system->num_chem_species; k++){ p->Q[k] = Q[k]; }
+    }
+    free(Q);
     return NULL;
 }
 
-void run_simulation(int num_threads, system_t* system){
+static double probe_seconds(system_t* system, int num_threads){
+    struct probe_arg* targs = (struct probe_arg*) malloc(sizeof(struct probe_arg)*num_threads);
+    pthread_t* thread_handles = (pthread_t*) malloc(sizeof(pthread_t)*num_threads);
+    double best = -1.0;
+    int r, i;
+    for(r=0; r<AUTOTUNE_PROBE_REPEATS; r++){
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        // same partition of the particle list as run_simulation()
+        int num_particles_per_thread = system->particle_list->count / num_threads;
+        node_t*particle_list_ittr = system->particle_list->head;
+        for(i=0; i<num_threads; i++){
+            targs[i].system = system;
+            targs[i].my_first_particle = particle_list_ittr;
+            targs[i].num_my_particles = (i==num_threads-1) ?
+                system->particle_list->count - i*num_particles_per_thread : num_particles_per_thread;
+            if(i < num_threads-1){
+                int j;
+                for(j=0; j<num_particles_per_thread && particle_list_ittr!=NULL; j++){
+                    particle_list_ittr = particle_list_ittr->next;
+                }
+            }
+            pthread_create(&thread_handles[i], NULL, probe_thread, &targs[i]);
+        }
+        for(i=0; i<num_threads; i++){
+            pthread_join(thread_handles[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - start.tv_sec) + 1e-9*(end.tv_nsec - start.tv_nsec);
+        if(best < 0.0 || elapsed < best){ best = elapsed; }
+    }
+    free(targs);
+    free(thread_handles);
+    return best;
+}
+
+int choose_num_threads(system_t* system, char* report, size_t report_size){
+    int online = get_num_processors();
+    int affinity = get_num_affinity_processors();
+    double quota = get_cgroup_cpu_quota();
+    int usable = get_num_usable_processors();
+    int by_particles = system->particle_list->count / AUTOTUNE_MIN_PARTICLES_PER_THREAD;
+    if(by_particles < 1){ by_particles = 1; }
+    int max_threads = (usable < by_particles) ? usable : by_particles;
+    // the probe computes the forces
+    diffusion_masks__build(system);
+    size_t len = snprintf(report, report_size,
+        "usable cpus %i (online %i, affinity %i, cgroup quota %s%.2g), %li particles allow %i",
+        usable, online, affinity, quota > 0.0 ? "" : "none ", quota, (long)system->particle_list->count, by_particles);
+    if(max_threads <= 1){
+        return 1;
+    }
+    int num_candidates = 0, t;
+    for(t=1; t<max_threads; t*=2){ num_candidates++; }
+    num_candidates++;
+    if(system->nt - system->start_step < AUTOTUNE_MIN_STEPS_PER_PROBE*AUTOTUNE_PROBE_REPEATS*num_candidates){
+        if(len < report_size){
+            snprintf(report+len, report_size-len, ", run too short to probe");
+        }
+        return max_threads;
+    }
+    // the neighbor search needs the sorted index, sorting it again at the
+    // first step is a no-op
+    linked_list_sort(system->x_index, 0);
+    int best_threads = 1;
+    double best_seconds = -1.0;
+    for(t=1; ; t = (2*t < max_threads) ? 2*t : max_threads){
+        double seconds = probe_seconds(system, t);
+        if(len < report_size){
+            len += snprintf(report+len, report_size-len, "%s%i:%.3gms", t==1 ? ", probe " : " ", t, 1e3*seconds);
+        }
+        if(best_seconds < 0.0 || seconds < best_seconds){
+            best_seconds = seconds;
+            best_threads = t;
+        }
+        if(t == max_threads){ break; }
+    }
+    return best_threads;
+}
+
+// Adaptive time stepping, see dt_control.h.  Times closer than this fraction
+// of dt_nominal are equal, so the steps land on the output times.
+#define ADAPTIVE_DT_TOLERANCE 1e-9
+
+static int adaptive_dt__reached(system_t* system, double t){
+    return system->time >= t - ADAPTIVE_DT_TOLERANCE * system->dt_nominal;
+}
+
+static int adaptive_dt__running(system_t* system, unsigned int step){
+    if(system->adaptive_dt){
+        return !adaptive_dt__reached(system, system->nt * system->dt_nominal);
+    }
+    return step < system->nt;
+}
+
+// The first output and reduction at or after the current time, and the size of
+// the first step unless it was restored from a checkpoint or an earlier run
+static void adaptive_dt__begin(system_t* system, unsigned int* next_output_step, double* next_reduction_time){
+    if(system->dt_nominal <= 0.0){
+        system->dt_nominal = system->dt;
+    }
+    if(system->dt_next <= 0.0){
+        system->dt_next = dt_control__initial_dt(system);
+    }
+    double tol = ADAPTIVE_DT_TOLERANCE * system->dt_nominal;
+    if(system->output_freq > 0){
+        double interval = system->output_freq * system->dt_nominal;
+        *next_output_step = (unsigned int) ceil((system->time - tol) / interval) * system->output_freq;
+    }
+    if(system->reduction_freq > 0){
+        double interval = system->reduction_freq * system->dt_nominal;
+        *next_reduction_time = ceil((system->time - tol) / interval) * interval;
+    }
+}
+
+// Set system->dt for the next step: the stable step size, shortened to end at
+// 'target' or at the end of the run if it would pass them.  Returns the time
+// at the end of the step.
+static double adaptive_dt__choose(system_t* system, double target){
+    double end_time = system->nt * system->dt_nominal;
+    if(end_time < target){
+        target = end_time;
+    }
+    double t = system->time + system->dt_next;
+    if(t >= target - ADAPTIVE_DT_TOLERANCE * system->dt_nominal){
+        system->dt = target - system->time;
+        return target;
+    }
+    system->dt = system->dt_next;
+    return t;
+}
+
+// The fluid steps the RDME has not been advanced over yet, see system->rdme_steps
+typedef struct {
+    double start;  // time at the start of the first of them
+    double dt;
+    unsigned int steps;
+} rdme_pending_t;
+
+static void rdme_pending__add(rdme_pending_t* pending, system_t* system){
+    if(pending->steps == 0){
+        pending->start = system->time;
+        pending->dt = 0.0;
+    }
+    pending->dt += system->dt;
+    pending->steps++;
+}
+
+// Advance the RDME over the pending fluid steps in one step of their total length
+static void rdme_pending__run(rdme_pending_t* pending, system_t* system, unsigned int step, run_timer_t* timer){
+    if(pending->steps == 0){
+        return;
+    }
+    double start = run_timer__now();
+    if(debug_flag) printf("[%i] starting RDME simulation over %u steps\n",step,pending->steps);
+    simulate_rdme(system, pending->start, pending->dt);
+    if(debug_flag) printf("[%i] Finish RDME simulation\n",step);
+    run_timer__add(timer, RUN_PHASE_RDME, start);
+    pending->steps = 0;
+}
+
+int run_simulation(int num_threads, system_t* system, const char* threads_reason){
     //
     int i,j;
     int num_particles_per_thread = system->particle_list->count / num_threads;
     //int num_bonds_per_thread = system->bond_list->count / num_threads;
-    // start worked threads
-    struct arg*targs = (struct arg*) malloc(sizeof(struct arg)*num_threads);
-    pthread_t* thread_handles = (pthread_t*) malloc(sizeof(pthread_t)*num_threads);
-    // create barrier that unblocks when "num_threads+1" call wait() on it
-    pthread_barrier_init(&begin_step_barrier, NULL, num_threads+1);
-    pthread_barrier_init(&end_step_barrier, NULL, num_threads+1);
-    // create all the worker threads
+    diffusion_masks__build(system);
+    if(system->implicit_diffusion && !system->static_domain){
+        printf("Error: implicit diffusion is only supported in static domains\n");
+        exit(1);
+    }
+    // the threads of an earlier run are reused
+    thread_pool_t* pool = system->thread_pool;
+    if(pool != NULL && pool->num_workers != num_threads){
+        thread_pool__destroy(system);
+        pool = NULL;
+    }
+    if(pool == NULL){
+        pool = thread_pool__create(system, num_threads);
+        system->thread_pool = pool;
+    }
+    // assign the particles to the worker threads
     int num_particles_left = system->particle_list->count;
     node_t*particle_list_ittr = system->particle_list->head;
     for (i=0; i < num_threads; i++) {
-        targs[i].system = system;
-        targs[i].num_threads = num_threads;
-        targs[i].thread_id = i;
-        targs[i].my_first_particle = particle_list_ittr;
+        struct arg* targ = &pool->worker_args[i];
+        targ->my_first_particle = particle_list_ittr;
         if(i==num_threads-1){
-            targs[i].num_my_particles = num_particles_left;
+            targ->num_my_particles = num_particles_left;
         }else{
-            targs[i].num_my_particles = num_particles_per_thread;
+            targ->num_my_particles = num_particles_per_thread;
             num_particles_left -= num_particles_per_thread;
             for(j=0;j<num_particles_per_thread;j++){
                 particle_list_ittr = particle_list_ittr->next;
@@ -149,53 +635,87 @@ void run_simulation(int num_threads, system_t* system){
                 }
             }
         }
-        if(debug_flag) printf("Creating thread to process %i particles\n", targs[i].num_my_particles);
-        pthread_create(&thread_handles[i], NULL, run_simulation_thread, &targs[i]);
+        worker__assign_roles(targ, system);
+        if(debug_flag) printf("Worker thread %i processes %i particles (%u fluid, %u wall, %u static)\n", i, targ->num_my_particles,
+                              targ->num_role_particles[PARTICLE_ROLE_FLUID], targ->num_role_particles[PARTICLE_ROLE_WALL],
+                              targ->num_role_particles[PARTICLE_ROLE_STATIC]);
     }
-    // Create threads to sort indexes
-    pthread_t* sort_thread_handles = (pthread_t*) malloc(sizeof(pthread_t)*3);
-    pthread_barrier_init(&begin_sort_barrier, NULL, 2);
-    pthread_barrier_init(&end_sort_barrier, NULL, 2);
-    struct sarg sort_args[1];
-    sort_args[0].ll = system->x_index;
-    sort_args[0].sort_ndx = 0;
-    pthread_create(&sort_thread_handles[0], NULL, sort_index_thread, &sort_args[0]);
-    if(debug_flag) printf("Creating thread to update x-position index\n");
-    /*sort_args[1].ll = system->y_index;
-    sort_args[1].sort_index = 1;
-    pthread_create(&sort_thread_handles[1], NULL, sort_index_thread, &sort_args[1]);
-    sort_args[2].ll = system->z_index;
-    sort_args[2].sort_index = 2;
-    pthread_create(&sort_thread_handles[2], NULL, sort_index_thread, &sort_args[2]);*/
 
-    // Create thread to handle output
-    pthread_t* output_thread_handles = (pthread_t*) malloc(sizeof(pthread_t)*1);
-    pthread_barrier_init(&begin_output_barrier, NULL, 2);
-    pthread_barrier_init(&end_output_barrier, NULL, 2);
-    pthread_create(&output_thread_handles[0], NULL, output_system_thread, system);
-    if(debug_flag) printf("Creating thread to create output files\n");
+    if(system->reduction_freq > 0){
+        reduction__create(system, num_threads);
+    }
+    run_report__begin(system, num_threads, threads_reason);
+    run_timer_t* timer = RUN_TIMER_MAIN(system->run_report);
+    // Release the parked threads
+    pool->run_finished = 0;
+    pthread_barrier_wait(&pool->begin_run_barrier);
 
     // Start simulation, coordinate simulation
-    int step,next_output_step = 0;
-    for(step=0; step < system->nt; step++){
+    int step;
+    unsigned int next_output_step = 0;
+    double next_reduction_time = 0.0;
+    if(system->adaptive_dt){
+        adaptive_dt__begin(system, &next_output_step, &next_reduction_time);
+    }else if(system->output_freq > 0){
+        // after a restart, continue with the next output at or after the start step
+        next_output_step = ((system->start_step + system->output_freq - 1) / system->output_freq) * system->output_freq;
+    }
+    // set when the adaptive time step became unstable, the run ends early
+    int failed = (system->adaptive_dt && system->dt_next <= 0.0);
+    rdme_pending_t rdme_pending = {0.0, 0.0, 0};
+    for(step=system->start_step; !failed && adaptive_dt__running(system, step); step++){
+        int output_due, reduction_due;
+        if(system->adaptive_dt){
+            output_due = (system->output_freq > 0 && adaptive_dt__reached(system, next_output_step * system->dt_nominal));
+            reduction_due = (system->reduction != NULL && adaptive_dt__reached(system, next_reduction_time));
+        }else{
+            system->time = step * system->dt;
+            output_due = (system->output_freq > 0 && step >= next_output_step);
+            reduction_due = (system->reduction != NULL && step % system->reduction_freq == 0);
+        }
+        int checkpoint_due = checkpoint_requested || (system->checkpoint_freq > 0 &&
+                             step > system->start_step && step % system->checkpoint_freq == 0);
+        // outputs, reductions and checkpoints see the RDME at the current time
+        if(output_due || reduction_due || checkpoint_due){
+            rdme_pending__run(&rdme_pending, system, step, timer);
+        }
         // Release the Sort Index threads
         if(debug_flag) printf("[%i] Starting the Sort Index threads\n",step);
-        pthread_barrier_wait(&begin_sort_barrier);
+        double start = run_timer__now();
+        pthread_barrier_wait(&pool->begin_sort_barrier);
         // Output state
-        if(step >= next_output_step){
-            // Release output thread
-            current_step = step;
-            if(debug_flag) printf("[%i] Starting the Output threads\n",step);
-            pthread_barrier_wait(&begin_output_barrier);
-            next_output_step += system->output_freq;
-            // Wait until output threads are done
-            pthread_barrier_wait(&end_output_barrier);
-            if(debug_flag) printf("[%i] Output threads finished\n",step);
-
+        if(output_due && !checkpoint_due){
+            release_output_thread(pool, step, next_output_step, 1, 0);
         }
         // Wait until Sort Index threads are done
-        pthread_barrier_wait(&end_sort_barrier);
+        pthread_barrier_wait(&pool->end_sort_barrier);
         if(debug_flag) printf("[%i] Sort Index threads finished\n",step);
+        // A checkpoint has to record the sorted index
+        if(checkpoint_due){
+            release_output_thread(pool, step, next_output_step, output_due, 1);
+        }
+        if(output_due){
+            next_output_step += system->output_freq;
+        }
+        if(reduction_due && system->adaptive_dt){
+            next_reduction_time += system->reduction_freq * system->dt_nominal;
+        }
+        // the step ends at the next output or at the end of the run if it would pass them
+        double end_of_step = 0.0;
+        if(system->adaptive_dt){
+            end_of_step = adaptive_dt__choose(system, system->output_freq > 0 ? next_output_step * system->dt_nominal : INFINITY);
+            if(debug_flag) printf("[%i] adaptive step of %e at time %e\n",step,system->dt,system->time);
+        }
+        run_timer__add(timer, RUN_PHASE_BARRIER_WAIT, start);
+        if(checkpoint_requested){
+            // wait for the checkpoint to be written, then exit as if the signal was not caught
+            pool->output_snapshot = 0;
+            pool->output_checkpoint = 0;
+            pthread_barrier_wait(&pool->begin_output_barrier);
+            if(debug_flag) printf("[%i] Checkpoint written, exiting\n",step);
+            signal(checkpoint_requested, SIG_DFL);
+            raise(checkpoint_requested);
+        }
         if(debug_flag>2 && step==0){
             printf("x_index = [");
             node_t*n;
@@ -212,49 +732,96 @@ void run_simulation(int num_threads, system_t* system){
 
         // Release the worker threads to take step
         if(debug_flag) printf("[%i] Starting the Worker threads\n",step);
-        pthread_barrier_wait(&begin_step_barrier);
-        unsigned int nsubsteps = get_number_of_substeps();
-        for(int substep=0;substep < nsubsteps; substep++){
+        start = run_timer__now();
+        pool->reduction_due = reduction_due;
+        pthread_barrier_wait(&pool->begin_step_barrier);
+        unsigned int nphases = get_number_of_phases();
+        for(int phase=0;phase < nphases; phase++){
             // Wait until worker threads are done
-            pthread_barrier_wait(&end_step_barrier);
-            if(debug_flag) printf("[%i] Worker threads finished substep %i/%i\n",step,substep,nsubsteps);
+            pthread_barrier_wait(&pool->end_step_barrier);
+            if(debug_flag) printf("[%i] Worker threads finished phase %i/%i\n",step,phase,nphases);
+            if(phase == 0 && reduction_due){
+                reduction__write(system, step);
+            }
         }
-        // Solve RDME 
-        if(debug_flag) printf("[%i] starting RDME simulation\n",step);
-        simulate_rdme(system, step);
-        if(debug_flag) printf("[%i] Finish RDME simulation\n",step);
+        if(system->adaptive_dt){
+            dt_limits_t limits;
+            dt_limits__clear(&limits);
+            for(i=0; i<num_threads; i++){
+                dt_limits__fold(&limits, &pool->worker_args[i].dt_limits);
+            }
+            system->dt_next = dt_control__stable_dt(system, &limits);
+            failed = (system->dt_next <= 0.0);
+        }
+        // The neighbors of a static domain are those of the first step, its
+        // diffusion operator is assembled once they are known
+        if(system->static_domain && system->chem_diffusion == NULL && system->num_chem_species > 0){
+            system->chem_diffusion = chem_diffusion__create(system);
+        }
+        if(system->implicit_diffusion && system->chem_diffusion != NULL){
+            double diffusion_start = run_timer__now();
+            chem_diffusion__solve_implicit(system->chem_diffusion, system, system->dt);
+            run_timer__add(timer, RUN_PHASE_DIFFUSION, diffusion_start);
+        }
+        run_timer__add(timer, RUN_PHASE_BARRIER_WAIT, start);
+        // Solve RDME, every rdme_steps fluid steps
+        rdme_pending__add(&rdme_pending, system);
+        if(rdme_pending.steps >= system->rdme_steps){
+            rdme_pending__run(&rdme_pending, system, step, timer);
+        }
+        if(system->adaptive_dt){
+            system->time = end_of_step;
+        }
+    }
+    rdme_pending__run(&rdme_pending, system, step, timer);
+    double start = run_timer__now();
+    int reduction_due;
+    if(system->adaptive_dt){
+        reduction_due = (system->reduction != NULL && adaptive_dt__reached(system, next_reduction_time));
+    }else{
+        system->time = step * system->dt;
+        reduction_due = (system->reduction != NULL && step % system->reduction_freq == 0);
     }
     // Record final timepoint
-    current_step = step;
-    if(debug_flag) printf("[%i] Starting the Output threads\n",step);
-    pthread_barrier_wait(&begin_output_barrier);
-    pthread_barrier_wait(&end_output_barrier);
-    if(debug_flag) printf("[%i] Output threads finished\n",step);
+    if(system->output_freq > 0 && !failed){
+        release_output_thread(pool, step, system->adaptive_dt ? system->nt : step, 1, 0);
+    }
+    // Wait for the async output (of the final timepoint or of a checkpoint),
+    // the output thread then sees run_finished and parks, as do the workers
+    pool->run_finished = 1;
+    pthread_barrier_wait(&pool->begin_step_barrier);
     if(debug_flag) printf("[%i] Waiting for Async Output threads\n",step);
-    pthread_barrier_wait(&begin_output_barrier); // wait for the async 
+    pthread_barrier_wait(&pool->begin_output_barrier);
     if(debug_flag) printf("[%i] Async Output threads finished\n",step);
-
-    //clean up
-    if(debug_flag) printf("Cleaning up RDME\n");
-    destroy_rdme(system);
-
-    // Kill threads and wait for them to finish
-    /*
-    if(debug_flag) printf("Cleaning up threads\n");
-    for(i=0;i<3;i++){
-        pthread_kill(sort_thread_handles[i], SIGINT);
-        pthread_join(sort_thread_handles[i], NULL);
+    run_timer__add(timer, RUN_PHASE_BARRIER_WAIT, start);
+    run_report__end(system, step);
+    if(system->output_stream != NULL){
+        fclose(system->output_stream);
+        system->output_stream = NULL;
     }
-    pthread_kill(output_thread_handles[0], SIGINT);
-    pthread_join(output_thread_handles[0], NULL);
-    for (i=0; i < num_threads; i++) {
-        pthread_kill(thread_handles[i], SIGINT);
-        pthread_join(thread_handles[i], NULL);
+    if(system->reduction != NULL){
+        if(reduction_due){
+            node_t*n;
+            for(i=0; i<num_threads; i++){
+                reduction__clear(system, i);
+            }
+            for(n=system->particle_list->head; n!=NULL; n=n->next){
+                reduction__accumulate(n->data, system, 0);
+            }
+            reduction__write(system, step);
+        }
+        reduction__destroy(system);
     }
-    */
+
+    // Park the sort thread, the workers have returned from the step loop
+    pthread_barrier_wait(&pool->begin_sort_barrier);
+    pthread_barrier_wait(&pool->end_run_barrier);
+    // a next run of the system continues from here (system->time is kept)
+    system->start_step = step;
+
     // done
     if(debug_flag) printf("Simulation complete\n");;
-    return;
+    return failed ? -1 : 0;
 }
 
 
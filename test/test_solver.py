@@ -1,7 +1,14 @@
 #!/usr/bin/env python3
 
+import fcntl
+import json
+import os
 import pickle
+import tempfile
 import unittest
+import unittest.mock
+
+import numpy
 
 import spatialpy
 
@@ -26,6 +33,37 @@ class diffusion_debug(spatialpy.Model):
         self.num_timesteps = 10
         self.output_freq = 1
 
+
+class Walls(spatialpy.Geometry):
+    def inside(self, x, on_boundary):
+        return x[0] < 0.0 or x[0] > 1.0 or x[1] < 0.0 or x[1] > 1.0
+
+
+class settling_flow(spatialpy.Model):
+    """ Fluid in a box of fixed walls, with a denser disc in the middle that
+    spreads out and settles.  timestep_size is stable for the whole flow. """
+
+    def __init__(self, model_name="settling_flow_test", density_ratio=1.5):
+        spatialpy.Model.__init__(self, model_name)
+
+        nx, num_walls, rho0, c0 = 20, 3, 1.0, 10.0
+        dx = 1.0 / (nx - 1)
+        lim = (-(num_walls - 1) * dx, 1.0 + (num_walls - 1) * dx)
+        nx_total = nx + 2 * num_walls
+        mass = rho0 * (lim[1] - lim[0])**2 / nx_total**2
+        self.mesh = spatialpy.Mesh.create_2D_domain(
+            xlim=lim, ylim=lim, nx=nx_total, ny=nx_total, type_id=1, mass=mass, nu=0.1,
+            fixed=False, rho0=rho0, c0=c0, P0=rho0 * c0**2
+        )
+        self.set_type(Walls(), 2, mass=mass, fixed=True)
+        x = numpy.asarray(self.mesh.vertices)
+        self.mesh.mass = numpy.asarray(self.mesh.mass, dtype=float)
+        self.mesh.mass[numpy.linalg.norm(x[:, :2] - 0.5, axis=1) < 0.25] *= density_ratio
+
+        self.staticDomain = False
+        self.timestep_size = 5e-5
+        self.num_timesteps = 400
+        self.output_freq = 100
 # class testPeriodicDiffusion(spatialpy.Model):
 #     def __init__(self, model_name="test1D"):
 #         spatialpy.Model.__init__(self, model_name)
@@ -83,6 +121,78 @@ class TestSolverFunctionality(unittest.TestCase):
         result2 = solver.run()
         self.assertFalse(result1 == result2)
 
+    def test_compile_cache(self):
+        """ Test that models which only differ in their mesh or initial condition share the compiled solver. """
+        solver1 = spatialpy.Solver(self.model)
+        solver1.compile()
+        model2 = diffusion_debug()
+        model2.listOfInitialConditions[0].count = 10
+        solver2 = spatialpy.Solver(model2)
+        solver2.compile()
+        self.assertEqual(solver1.executable_path, solver2.executable_path)
+        A = solver2.run(seed=1).get_species("A", 0)
+        self.assertEqual(A.sum(), 10)
+        model3 = diffusion_debug()
+        model3.mesh = spatialpy.Mesh.create_2D_domain(
+            xlim=[-2, 2], ylim=[-1, 1], nx=40, ny=20, type_id=1.0,
+            mass=1.0, nu=1.0, fixed=True, rho0=1.0, c0=1.0, P0=1.0)
+        solver3 = spatialpy.Solver(model3)
+        solver3.compile()
+        self.assertEqual(solver1.executable_path, solver3.executable_path)
+        for result in [solver3.run(seed=1), solver3.run(seed=1, in_process=True)]:
+            A = result.get_species("A", -1)
+            self.assertEqual(A.shape, (800,))
+            self.assertEqual(A.sum(), 1000)
+
+    def test_cache_eviction_skips_used_entries(self):
+        """ Test that eviction keeps cache entries locked by a running solver, and their lock files. """
+        with tempfile.TemporaryDirectory() as cache_dir, \
+                unittest.mock.patch.dict(os.environ, {"SPATIALPY_CACHE_DIR": cache_dir}), \
+                unittest.mock.patch.object(spatialpy.Solver, "CACHE_MAX_MODELS", 1):
+            solver1 = spatialpy.Solver(self.model)
+            solver1.compile()
+            entry = os.path.dirname(solver1.executable_path)
+            model2 = diffusion_debug()
+            model2.add_species(spatialpy.Species(name="B", diffusion_constant=0.0))
+            with open(entry + ".lock") as lock_fd:
+                fcntl.flock(lock_fd, fcntl.LOCK_SH)
+                spatialpy.Solver(model2).compile()
+                self.assertTrue(os.path.isfile(solver1.executable_path))
+            spatialpy.Solver(model2).compile()
+            self.assertFalse(os.path.exists(entry))
+            self.assertTrue(os.path.isfile(entry + ".lock"))
+            A = solver1.run(seed=1).get_species("A", -1)
+            self.assertEqual(A.sum(), 1000)
+
+    def test_parameter_sweep(self):
+        """ Test that parameter values can be changed without compiling the solver again. """
+        model = diffusion_debug()
+        k = spatialpy.Parameter(name="k", expression=0.0)
+        model.add_parameter(k)
+        model.add_reaction(spatialpy.Reaction(
+            name="decay", reactants={model.listOfSpecies["A"]: 1}, products={}, rate=k))
+        solver = spatialpy.Solver(model)
+        results = solver.run(seed=1, parameters=[{}, {"k": 1.0}])
+        self.assertEqual(len(results), 2)
+        self.assertEqual(results[0].get_species("A", -1).sum(), 1000)
+        self.assertLess(results[1].get_species("A", -1).sum(), 1000)
+
+    def test_parameter_names(self):
+        """ Test that parameters named like identifiers of the generated code keep their value. """
+        model = diffusion_debug(diffusion_constant=0.0)
+        A = model.listOfSpecies["A"]
+        B = spatialpy.Species(name="B", diffusion_constant=0.0)
+        model.add_species(B)
+        with self.assertRaises(spatialpy.ModelError):
+            model.add_parameter(spatialpy.Parameter(name="sd", expression=1.0))
+        ptr = spatialpy.Parameter(name="ptr", expression=1.0)
+        model.add_parameter(ptr)
+        model.add_reaction(spatialpy.Reaction(name="r1", reactants={A: 1}, products={B: 1}, rate=ptr))
+        result = model.run(seed=1)
+        B_total = result.get_species("B", -1).sum()
+        self.assertGreater(B_total, 0)
+        self.assertEqual(result.get_species("A", -1).sum() + B_total, 1000)
+
     def test_mesh_pickle(self):
         meshstr = pickle.dumps(self.model.mesh)
         mesh = pickle.loads(meshstr)
@@ -118,6 +228,290 @@ class TestSolverFunctionality(unittest.TestCase):
         result_list = self.model.run(3)
         self.assertEqual(len(result_list), 3)
 
+    def test_get_species_timepoints(self):
+        """ Test that reading all timepoints at once matches reading them one at a time. """
+        result = self.model.run(seed=1)
+        A = result.get_species("A")
+        self.assertEqual(A.shape[0], len(result.get_timespan()))
+        for t_ndx in range(A.shape[0]):
+            self.assertFalse((A[t_ndx] - result.get_species("A", t_ndx)).any())
+        self.assertTrue((A[-1] != A[0]).any())
+
+    def test_reductions(self):
+        """ Test that the in-situ reductions agree with the output files. """
+        model = diffusion_debug()
+        model.set_reductions(model.timestep_size, histogram_axis=0, num_bins=5)
+        result = model.run(seed=1)
+        reductions = result.get_reductions()
+        self.assertEqual(len(reductions["step"]), model.num_timesteps + 1)
+        A = result.get_species("A", -1)
+        self.assertEqual(reductions["D[A][1]"][-1], A.sum())
+        hist = sum(reductions["hist_D[A][{0}]".format(b)] for b in range(5))
+        self.assertFalse((hist - reductions["D[A][1]"]).any())
+        # reductions only, without output files
+        model.output_freq = 0
+        result = model.run(seed=1)
+        self.assertEqual(len(result.get_reductions()["step"]), model.num_timesteps + 1)
+        with self.assertRaises(spatialpy.ResultError):
+            result.get_species("A")
+
+    def test_run_report(self):
+        """ Test that the run report covers the whole run and counts the RDME events. """
+        solver = spatialpy.Solver(self.model)
+        for result in [solver.run(seed=1), solver.run(seed=1, in_process=True)]:
+            report = result.get_run_report()
+            self.assertEqual(report["end_step"] - report["start_step"], self.model.num_timesteps)
+            self.assertEqual(len(report["threads"]), report["num_threads"] + 3)
+            # no number_of_threads, the engine chose them
+            self.assertIn("usable cpus", report["threads_reason"])
+            self.assertGreater(report["phases"]["rdme"], 0)
+            self.assertGreater(report["counters"]["neighbor_pairs"], 0)
+            self.assertGreater(report["counters"]["rdme_diffusions"], 0)
+            self.assertEqual(report["counters"]["rdme_reactions"], 0)
+
+    def test_adaptive_timestep(self):
+        """ Test that adaptive time steps without fluid particles are of timestep_size and write the outputs at the timespan. """
+        model = diffusion_debug()
+        model.staticDomain = False
+        model.set_adaptive_timestep()
+        result = model.run(seed=1)
+        report = result.get_run_report()
+        self.assertEqual(report["end_step"] - report["start_step"], model.num_timesteps)
+        self.assertAlmostEqual(report["end_time"], model.num_timesteps * model.timestep_size)
+        A = result.get_species("A")
+        self.assertEqual(A.shape[0], len(result.get_timespan()))
+        self.assertEqual(A[-1].sum(), 1000)
+
+    def test_adaptive_timestep_settling(self):
+        """ Test that a settling flow takes fewer adaptive steps than steps of a fixed stable size. """
+        model = settling_flow()
+        fixed = model.run(seed=1)
+        model.set_adaptive_timestep()
+        result = model.run(seed=1)
+        report = result.get_run_report()
+        self.assertLess(report["end_step"] - report["start_step"], model.num_timesteps)
+        self.assertAlmostEqual(report["end_time"], model.num_timesteps * model.timestep_size)
+        self.assertEqual(len(result.get_timespan()), len(fixed.get_timespan()))
+        rho = result.get_property("rho", -1)
+        self.assertTrue(numpy.isfinite(rho).all())
+        self.assertLess(numpy.abs(rho - fixed.get_property("rho", -1)).max(), 0.05)
+        # steps of at most max_timestep
+        model.set_adaptive_timestep(max_timestep=model.timestep_size / 2)
+        report = model.run(seed=1).get_run_report()
+        self.assertGreaterEqual(report["end_step"] - report["start_step"], 2 * model.num_timesteps)
+
+    def test_adaptive_timestep_unstable(self):
+        """ Test that an unstable flow ends the run with a SimulationError, also in process. """
+        model = settling_flow(density_ratio=3.0)
+        model.set_adaptive_timestep()
+        for in_process in [False, True]:
+            with self.assertRaises(spatialpy.SimulationError):
+                model.run(seed=1, in_process=in_process)
+
+    def test_multirate(self):
+        """ Test that the RDME and the chemistry can step at other rates than the fluid. """
+        model = diffusion_debug(diffusion_constant=0.0)
+        k = spatialpy.Parameter(name="k", expression=1.0)
+        model.add_parameter(k)
+        model.add_reaction(spatialpy.Reaction(
+            name="decay", reactants={model.listOfSpecies["A"]: 1}, products={}, rate=k))
+        model.output_freq = 5
+        model.set_multirate(rdme_steps=5, chemistry_substeps=4)
+        result = model.run(seed=1)
+        self.assertEqual(len(result.get_timespan()), 3)
+        # four explicit chemistry steps of dt/4 in each of the ten steps
+        C = result.get_species("A", deterministic=True)
+        self.assertAlmostEqual(C[-1].sum(), 1000 * (1 - model.timestep_size / 4)**40, places=6)
+        self.assertLess(result.get_species("A", -1).sum(), 1000)
+        self.assertGreater(result.get_run_report()["counters"]["rdme_reactions"], 0)
+
+    def test_rosenbrock_chemistry(self):
+        """ Test that stiff deterministic reactions reach their equilibrium with steps far above their time scale. """
+        model = diffusion_debug(diffusion_constant=0.0)
+        A = model.listOfSpecies["A"]
+        B = spatialpy.Species(name="B", diffusion_constant=0.0)
+        model.add_species([B])
+        kf = spatialpy.Parameter(name="kf", expression=1000.0)
+        kr = spatialpy.Parameter(name="kr", expression=500.0)
+        model.add_parameter([kf, kr])
+        model.add_reaction([
+            spatialpy.Reaction(name="bind", reactants={A: 1}, products={B: 1}, rate=kf),
+            spatialpy.Reaction(name="unbind", reactants={B: 1}, products={A: 1}, rate=kr)])
+        model.enable_rdme = False
+        model.set_chemistry_integrator("rosenbrock")
+        result = model.run(seed=1)
+        self.assertAlmostEqual(result.get_species("A", -1, deterministic=True).sum(), 1000 / 3, places=4)
+        self.assertAlmostEqual(result.get_species("B", -1, deterministic=True).sum(), 2000 / 3, places=4)
+
+    def test_chemistry_stoichiometry(self):
+        """ Test that the deterministic reactions change the species of their own stoichiometry. """
+        model = diffusion_debug(diffusion_constant=0.0)
+        A = model.listOfSpecies["A"]
+        B = spatialpy.Species(name="B", diffusion_constant=0.0)
+        C = spatialpy.Species(name="C", diffusion_constant=0.0)
+        model.add_species([B, C])
+        k1 = spatialpy.Parameter(name="k1", expression=1.0)
+        k2 = spatialpy.Parameter(name="k2", expression=0.5)
+        model.add_parameter([k1, k2])
+        model.add_reaction([
+            spatialpy.Reaction(name="r1", reactants={A: 1}, products={B: 1}, rate=k1),
+            spatialpy.Reaction(name="r2", reactants={B: 1}, products={C: 1}, rate=k2)])
+        model.enable_rdme = False
+        result = model.run(seed=1)
+        totals = [result.get_species(s, -1, deterministic=True).sum() for s in ["A", "B", "C"]]
+        self.assertAlmostEqual(sum(totals), 1000, delta=1e-3)
+        self.assertLess(totals[0], 1000)
+        self.assertGreater(totals[1], 0)
+        self.assertGreater(totals[2], 0)
+        self.assertGreaterEqual(result.get_species("B", deterministic=True).min(), 0)
+
+    def test_diffusion_restriction(self):
+        """ Test that a restricted species does not diffuse into particles of the other types. """
+        class Right(spatialpy.Geometry):
+            def inside(self, x, on_boundary):
+                return x[0] > 0.05
+        model = diffusion_debug()
+        A = model.listOfSpecies["A"]
+        B = spatialpy.Species(name="B", diffusion_constant=0.01)
+        model.add_species([B])
+        model.add_initial_condition(spatialpy.PlaceInitialCondition(B, 1000, [0, 0, 0]))
+        model.set_type(Right(), 2)
+        model.restrict(A, [1])
+        model.enable_rdme = False
+        # a step the explicit diffusion is stable with on this mesh
+        model.timestep_size = 0.005
+        model.num_timesteps = 200
+        model.output_freq = 200
+        result = model.run(seed=1)
+        right = result.get_property("type", -1) == 2
+        CA = result.get_species("A", -1, deterministic=True)
+        CB = result.get_species("B", -1, deterministic=True)
+        self.assertAlmostEqual(CA.sum(), 1000, delta=1e-3)
+        self.assertAlmostEqual(CB.sum(), 1000, delta=1e-3)
+        self.assertEqual(CA[right].max(), 0)
+        self.assertGreater(CB[right].sum(), 1)
+
+    def test_implicit_diffusion(self):
+        """ Test that implicit diffusion stays positive and conserves mass with steps above the explicit limit. """
+        model = diffusion_debug(diffusion_constant=1.0)
+        model.enable_rdme = False
+        model.set_implicit_diffusion()
+        result = model.run(seed=1)
+        C = result.get_species("A", deterministic=True)
+        self.assertAlmostEqual(C[-1].sum(), 1000, delta=1e-3)
+        self.assertGreater(C.min(), -1e-9)
+        self.assertTrue((C[1:].max(axis=1) <= C[:-1].max(axis=1)).all())
+
+    def test_stream(self):
+        """ Test that streamed output is the same as the output read from files. """
+        solver = spatialpy.Solver(self.model)
+        result1 = solver.run(seed=1)
+        result2 = solver.run(seed=1, stream=True)
+        self.assertIsInstance(result2, spatialpy.StreamResult)
+        self.assertFalse((result1.get_species("A") - result2.get_species("A")).any())
+        result3 = solver.run(seed=1, stream=True)
+        self.assertTrue(result2 == result3)
+
+    def test_in_process(self):
+        """ Test that runs in this process give the same output as the solver executable. """
+        solver = spatialpy.Solver(self.model)
+        result1 = solver.run(seed=1, stream=True)
+        result2 = solver.run(seed=1, in_process=True)
+        self.assertTrue(result1 == result2)
+        result3 = solver.run(seed=1, in_process=True)
+        self.assertTrue(result2 == result3)
+
+    def test_continue_run(self):
+        """ Test that a system run again after raising its last step continues where the first run ended. """
+        solver = spatialpy.Solver(self.model)
+        library = solver.load_library()
+        lib = library.lib
+        particles = solver.particle_arrays
+        nt = self.model.num_timesteps
+        def run(num_steps_list, run_dir):
+            u0 = numpy.array(particles['u0'], dtype=numpy.uint32, order='C')
+            library.set_parameters(particles['parameters'])
+            system = lib.spatialpy_create_system()
+            cwd = os.getcwd()
+            os.chdir(run_dir)
+            try:
+                lib.spatialpy_set_domain(system, particles['domain'])
+                lib.spatialpy_add_particles(system, u0.shape[0], u0.shape[1], particles['x'], particles['type'],
+                                            particles['nu'], particles['mass'], particles['rho'],
+                                            particles['solid_tag'], u0)
+                lib.spatialpy_initialize_rdme(system, u0)
+                lib.spatialpy_seed(1)
+                for num_steps in num_steps_list:
+                    lib.spatialpy_set_num_steps(system, num_steps)
+                    lib.spatialpy_run_simulation(system, 1, None)
+                lib.spatialpy_write_run_report(system, b"report.json")
+            finally:
+                os.chdir(cwd)
+                lib.spatialpy_destroy_system(system)
+            with open(os.path.join(run_dir, "report.json")) as fd:
+                return json.load(fd)
+        with tempfile.TemporaryDirectory() as dir1, tempfile.TemporaryDirectory() as dir2:
+            report = run([nt, 2 * nt], dir1)
+            self.assertEqual(report["start_step"], nt)
+            self.assertEqual(report["end_step"], 2 * nt)
+            self.assertAlmostEqual(report["end_time"], 2 * nt * self.model.timestep_size)
+            run([2 * nt], dir2)
+            for step in range(2 * nt + 1):
+                with open(os.path.join(dir1, "output{0}.vtk".format(step)), "rb") as fd1, \
+                     open(os.path.join(dir2, "output{0}.vtk".format(step)), "rb") as fd2:
+                    self.assertEqual(fd1.read(), fd2.read())
+
+    def test_add_particles_twice(self):
+        """ Test that particles added in two calls get the same ids as those added in one call. """
+        solver = spatialpy.Solver(self.model)
+        library = solver.load_library()
+        lib = library.lib
+        particles = solver.particle_arrays
+        def run(parts, run_dir):
+            u0 = numpy.array(particles['u0'], dtype=numpy.uint32, order='C')
+            library.set_parameters(particles['parameters'])
+            system = lib.spatialpy_create_system()
+            cwd = os.getcwd()
+            os.chdir(run_dir)
+            try:
+                lib.spatialpy_set_domain(system, particles['domain'])
+                for part in parts:
+                    lib.spatialpy_add_particles(system, u0[part].shape[0], u0.shape[1], particles['x'][part],
+                                                particles['type'][part], particles['nu'][part],
+                                                particles['mass'][part], particles['rho'][part],
+                                                particles['solid_tag'][part], u0[part])
+                lib.spatialpy_initialize_rdme(system, u0)
+                lib.spatialpy_seed(1)
+                lib.spatialpy_run_simulation(system, 1, None)
+            finally:
+                os.chdir(cwd)
+                lib.spatialpy_destroy_system(system)
+        half = particles['u0'].shape[0] // 2
+        with tempfile.TemporaryDirectory() as dir1, tempfile.TemporaryDirectory() as dir2:
+            run([slice(None)], dir1)
+            run([slice(0, half), slice(half, None)], dir2)
+            for step in range(self.model.num_timesteps + 1):
+                with open(os.path.join(dir1, "output{0}.vtk".format(step)), "rb") as fd1, \
+                     open(os.path.join(dir2, "output{0}.vtk".format(step)), "rb") as fd2:
+                    self.assertEqual(fd1.read(), fd2.read())
+
+    def test_checkpoint_restart(self):
+        """ Test that restarting from a checkpoint gives the same output as an uninterrupted run. """
+        solver = spatialpy.Solver(self.model)
+        result1 = solver.run(seed=1)
+        result2 = spatialpy.Solver(self.model).run(seed=1, checkpoint_freq=5)
+        checkpoint = result2.get_checkpoint()
+        result3 = solver.run(restart=checkpoint)
+        for t_ndx in range(5, self.model.num_timesteps + 1):
+            self.assertFalse((result1.get_species("A", t_ndx) - result3.get_species("A", t_ndx)).any())
+        # a restart in the directory of the checkpoint keeps the reductions before it
+        model = diffusion_debug()
+        model.set_reductions(model.timestep_size)
+        result4 = spatialpy.Solver(model).run(seed=1, checkpoint_freq=5)
+        spatialpy.Solver(model).run(restart=result4)
+        steps = result4.get_reductions()["step"]
+        self.assertEqual(list(steps), list(range(model.num_timesteps + 1)))
+
     # def test_1D_periodic_boundary(self):
     #     """ Test if periodic boundary conditions are working. """
     #     result = self.periodic_model.run()